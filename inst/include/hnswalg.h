@@ -2,6 +2,7 @@
 
 #include "visited_list_pool.h"
 #include "hnswlib.h"
+#include "pforr/pforr.h"
 #include <atomic>
 #include <random>
 #include <stdlib.h>
@@ -9,16 +10,278 @@
 #include <unordered_set>
 #include <list>
 #include <memory>
+#include <future>
+#include <shared_mutex>
+#include <algorithm>
+#include <tuple>
+#include <new>
+#include <thread>
 
 namespace hnswlib {
 typedef unsigned int tableint;
 typedef unsigned int linklistsizeint;
 
+/*
+* A one byte spinlock guarding the link lists of a single element. A std::mutex per element costs 40 bytes (more
+* than the links of many indexes), while these locks are rarely contended and only held briefly, so spinning (and
+* yielding to other threads if it takes a while) is cheap. Searches don't take these locks at all.
+*/
+class ElementLock {
+    std::atomic<bool> locked_{false};
+
+ public:
+    void lock() {
+        while (locked_.exchange(true, std::memory_order_acquire)) {
+            while (locked_.load(std::memory_order_relaxed)) {
+                std::this_thread::yield();
+            }
+        }
+    }
+
+    bool try_lock() {
+        return !locked_.load(std::memory_order_relaxed) && !locked_.exchange(true, std::memory_order_acquire);
+    }
+
+    void unlock() {
+        locked_.store(false, std::memory_order_release);
+    }
+};
+
+/*
+* Held shared by each operation which modifies the index, and exclusively by those which need it to stay unchanged.
+* A std::shared_mutex keeps one count of its shared holders, so every insert would write the same cache line.
+* Instead, shared holders count themselves in one of STRIPES counters, each on its own cache line and picked per
+* thread, and an exclusive holder raises a flag and waits for all the counters to drain.
+*/
+class WriteBarrier {
+    static const size_t STRIPES = 128;
+
+    struct alignas(64) Stripe {
+        std::atomic<size_t> count{0};
+    };
+
+    std::unique_ptr<Stripe[]> stripes_{new Stripe[STRIPES]};
+    std::atomic<bool> exclusive_{false};
+    std::mutex exclusive_lock_;
+
+    static size_t stripeIndex() {
+        static std::atomic<size_t> next_stripe{0};
+        static thread_local size_t stripe = next_stripe.fetch_add(1, std::memory_order_relaxed) % STRIPES;
+        return stripe;
+    }
+
+ public:
+    void lock_shared() {
+        std::atomic<size_t> &count = stripes_[stripeIndex()].count;
+        while (true) {
+            // sequentially consistent, so either lock() sees the count or this sees the flag
+            count.fetch_add(1);
+            if (!exclusive_.load())
+                return;
+            count.fetch_sub(1);
+            while (exclusive_.load(std::memory_order_relaxed)) {
+                std::this_thread::yield();
+            }
+        }
+    }
+
+    void unlock_shared() {
+        stripes_[stripeIndex()].count.fetch_sub(1, std::memory_order_release);
+    }
+
+    void lock() {
+        exclusive_lock_.lock();
+        exclusive_.store(true);
+        for (size_t i = 0; i < STRIPES; i++) {
+            while (stripes_[i].count.load() != 0) {
+                std::this_thread::yield();
+            }
+        }
+    }
+
+    void unlock() {
+        exclusive_.store(false);
+        exclusive_lock_.unlock();
+    }
+
+    // turns this thread's exclusive hold into a shared one, with no gap in which another thread can take the
+    // barrier exclusively. Release it with unlock_shared from the same thread
+    void unlock_and_lock_shared() {
+        stripes_[stripeIndex()].count.fetch_add(1);
+        unlock();
+    }
+};
+
+/*
+* Append-only storage for the upper layer link lists. Lists are carved out of large blocks, which grow
+* geometrically with the total allocated, instead of being malloced one element at a time, and are all released
+* together by clear().
+*/
+class LinkListArena {
+    static const size_t MIN_BLOCK_SIZE = 1 << 16;
+    static const size_t MAX_BLOCK_SIZE = 1 << 24;
+    static const size_t ALIGNMENT = 8;
+
+    std::mutex lock_;
+    std::vector<std::unique_ptr<char[]>> blocks_;
+    size_t block_used_{0};
+    size_t block_capacity_{0};
+    size_t total_capacity_{0};
+
+ public:
+    // returns nbytes of uninitialized memory, aligned to ALIGNMENT
+    char *allocate(size_t nbytes) {
+        nbytes = (nbytes + ALIGNMENT - 1) & ~(ALIGNMENT - 1);
+        std::unique_lock <std::mutex> lock(lock_);
+        if (block_used_ + nbytes > block_capacity_) {
+            block_capacity_ = std::max(nbytes, std::min((size_t) MAX_BLOCK_SIZE, std::max((size_t) MIN_BLOCK_SIZE, total_capacity_)));
+            blocks_.emplace_back(new (std::nothrow) char[block_capacity_]);
+            if (!blocks_.back()) {
+                blocks_.pop_back();
+                block_capacity_ = 0;
+                throw std::runtime_error("Not enough memory: failed to allocate linklists");
+            }
+            total_capacity_ += block_capacity_;
+            block_used_ = 0;
+        }
+        char *dest = blocks_.back().get() + block_used_;
+        block_used_ += nbytes;
+        return dest;
+    }
+
+    void clear() {
+        std::unique_lock <std::mutex> lock(lock_);
+        blocks_.clear();
+        block_used_ = 0;
+        block_capacity_ = 0;
+        total_capacity_ = 0;
+    }
+
+    void swap(LinkListArena &other) {
+        std::scoped_lock lock(lock_, other.lock_);
+        blocks_.swap(other.blocks_);
+        std::swap(block_used_, other.block_used_);
+        std::swap(block_capacity_, other.block_capacity_);
+        std::swap(total_capacity_, other.total_capacity_);
+    }
+};
+
+/*
+* Fixed-size records for each element, stored in 64-byte aligned chunks of 2^chunk_shift_ elements (the last may
+* be smaller), so that growing the store allocates new chunks rather than moving the existing records.
+*/
+class ChunkedStore {
+    static const size_t MAX_CHUNK_BYTES = 1 << 26;
+    static const size_t ALIGNMENT = 64;
+
+    static char *allocateChunk(size_t nbytes) {
+        char *chunk = (char *) ::operator new(nbytes, std::align_val_t(ALIGNMENT), std::nothrow);
+        if (chunk == nullptr)
+            throw std::runtime_error("Not enough memory: failed to allocate level0");
+        return chunk;
+    }
+
+    static void freeChunk(char *chunk) {
+        ::operator delete(chunk, std::align_val_t(ALIGNMENT));
+    }
+
+ public:
+    std::vector<char *> chunks_;
+    size_t stride_{0};  // bytes per element
+    size_t chunk_shift_{0};
+    size_t capacity_{0};  // number of elements the chunks have room for
+
+    ChunkedStore() = default;
+    ChunkedStore(const ChunkedStore &) = delete;
+    ChunkedStore &operator=(const ChunkedStore &) = delete;
+
+    ~ChunkedStore() {
+        clear();
+    }
+
+    // empties the store and picks the number of elements per chunk: as many as fit in MAX_CHUNK_BYTES
+    void init(size_t stride) {
+        clear();
+        stride_ = stride;
+        chunk_shift_ = 0;
+        while (stride_ > 0 && (stride_ << (chunk_shift_ + 1)) <= MAX_CHUNK_BYTES)
+            chunk_shift_++;
+    }
+
+    /*
+    * Makes room for max_elements elements. Only the last chunk, which is allocated no larger than needed, is
+    * ever reallocated: the other elements stay where they are.
+    */
+    void reserve(size_t max_elements) {
+        const size_t chunk_elements = (size_t) 1 << chunk_shift_;
+        if (max_elements <= capacity_)
+            return;
+
+        size_t last_chunk_elements = capacity_ & (chunk_elements - 1);
+        if (last_chunk_elements > 0) {
+            size_t new_last_chunk_elements = std::min(chunk_elements, last_chunk_elements + max_elements - capacity_);
+            char *chunk = allocateChunk(new_last_chunk_elements * stride_);
+            memcpy(chunk, chunks_.back(), last_chunk_elements * stride_);
+            freeChunk(chunks_.back());
+            chunks_.back() = chunk;
+            capacity_ += new_last_chunk_elements - last_chunk_elements;
+        }
+
+        while (capacity_ < max_elements) {
+            size_t nelements = std::min(chunk_elements, max_elements - capacity_);
+            chunks_.push_back(allocateChunk(nelements * stride_));
+            capacity_ += nelements;
+        }
+    }
+
+    inline char *get(size_t internal_id) const {
+        return chunks_[internal_id >> chunk_shift_] + (internal_id & (((size_t) 1 << chunk_shift_) - 1)) * stride_;
+    }
+
+    /*
+    * Calls f(chunk, first, nelements) for each chunk holding the first nelements elements, where the chunk
+    * pointer is to element first and nelements of the elements in it are wanted.
+    */
+    template<typename F>
+    void forEachChunk(size_t nelements, F f) const {
+        const size_t chunk_elements = (size_t) 1 << chunk_shift_;
+        for (size_t first = 0, i = 0; first < nelements; first += chunk_elements, i++) {
+            f(chunks_[i], first, std::min(chunk_elements, nelements - first));
+        }
+    }
+
+    void clear() {
+        for (char *chunk : chunks_)
+            freeChunk(chunk);
+        chunks_.clear();
+        capacity_ = 0;
+    }
+
+    void swap(ChunkedStore &other) {
+        chunks_.swap(other.chunks_);
+        std::swap(stride_, other.stride_);
+        std::swap(chunk_shift_, other.chunk_shift_);
+        std::swap(capacity_, other.capacity_);
+    }
+};
+
+
+// the state of an index file written by HierarchicalNSW::saveIndexAsync
+struct IndexCheckpoint {
+    std::string location;
+    size_t file_size;
+    size_t element_count;
+};
+
+
 template<typename dist_t>
 class HierarchicalNSW : public AlgorithmInterface<dist_t> {
  public:
     static const tableint MAX_LABEL_OPERATION_LOCKS = 65536;
     static const unsigned char DELETE_MARK = 0x01;
+    static const unsigned int INDEX_LOG_MAGIC = 0x484c4f47;
+    static const tableint NO_INTERNAL_ID = (tableint) -1;
+    static const size_t LAYOUT_ALIGNMENT = 64;
 
     size_t max_elements_{0};
     mutable std::atomic<size_t> cur_element_count{0};  // current number of elements
@@ -32,23 +295,37 @@ class HierarchicalNSW : public AlgorithmInterface<dist_t> {
     size_t ef_{ 0 };
 
     double mult_{0.0}, revSize_{0.0};
-    int maxlevel_{0};
 
     std::unique_ptr<VisitedListPool> visited_list_pool_{nullptr};
 
     // Locks operations with element by label value
     mutable std::vector<std::mutex> label_op_locks_;
 
-    std::mutex global;
-    std::vector<std::mutex> link_list_locks_;
+    std::vector<ElementLock> link_list_locks_;
+    // held shared by operations which modify the index, and exclusively while it is copied by saveIndexAsync
+    WriteBarrier write_barrier_;
 
-    tableint enterpoint_node_{0};
+    // where searches start, and the top level of the graph, which is the level of the entry point
+    struct EntryPoint {
+        tableint id;
+        int level;  // -1 if the index is empty
+    };
+    // an EntryPoint packed by packEntryPoint, so that both are always read and updated together
+    std::atomic<uint64_t> entry_point_{0};
 
     size_t size_links_level0_{0};
     size_t offsetData_{0}, offsetLevel0_{0}, label_offset_{ 0 };
 
-    char *data_level0_memory_{nullptr};
+    // the level 0 record of each element: its links, then its data and label, unless separate_storage_ is set
+    ChunkedStore level0_store_;
+    // after useSeparateStorage, the data and labels of the elements are kept apart from their links
+    bool separate_storage_{false};
+    ChunkedStore data_store_;
+    ChunkedStore label_store_;
+    // set by useAlignedLayout: the links and data of each element are padded to start on a cache line
+    bool aligned_layout_{false};
     char **linkLists_{nullptr};
+    LinkListArena link_list_arena_;  // owns the memory linkLists_ point into
     std::vector<int> element_levels_;  // keeps level of each element
 
     size_t data_size_{0};
@@ -58,8 +335,21 @@ class HierarchicalNSW : public AlgorithmInterface<dist_t> {
 
     mutable std::mutex label_lookup_lock;  // lock for label_lookup_
     std::unordered_map<labeltype, tableint> label_lookup_;
-
-    std::default_random_engine level_generator_;
+    // used instead of label_lookup_ after useDenseLabels: the internal id of each label, or NO_INTERNAL_ID
+    bool dense_labels_{false};
+    std::vector<std::atomic<tableint>> dense_label_lookup_;
+    bool frozen_{false};  // set by freeze
+    // set by compressLinks: the level 0 links of each element are sorted and delta encoded in compressed_links_,
+    // instead of being stored in level0_store_. Elements are grouped into blocks of 2^compressed_block_shift_,
+    // and an element's links start compressed_link_offsets_[internal_id] bytes after the start of its block, at
+    // compressed_block_offsets_[block]
+    bool links_compressed_{false};
+    std::vector<uint8_t> compressed_links_;
+    size_t compressed_block_shift_{0};
+    std::vector<size_t> compressed_block_offsets_;
+    std::vector<uint16_t> compressed_link_offsets_;
+
+    size_t random_seed_{100};  // levels are a hash of this and the label, see getRandomLevel
     std::default_random_engine update_probability_generator_;
 
     mutable std::atomic<long> metric_distance_computations{0};
@@ -70,6 +360,13 @@ class HierarchicalNSW : public AlgorithmInterface<dist_t> {
     std::mutex deleted_elements_lock;  // lock for deleted_elements
     std::unordered_set<tableint> deleted_elements;  // contains internal ids of deleted elements
 
+    // State of the last full save or load, used by saveIndexIncremental to append only what changed since
+    std::string checkpoint_location_;
+    size_t checkpoint_file_size_{0};  // size of the full index file at checkpoint_location_
+    size_t checkpoint_file_element_count_{0};  // number of elements in the full index file
+    size_t checkpoint_element_count_{0};  // number of elements saved so far, including in the log
+    std::vector<char> element_modified_;  // flags elements below checkpoint_element_count_ changed since then
+
 
     HierarchicalNSW(SpaceInterface<dist_t> *s) {
     }
@@ -80,9 +377,10 @@ class HierarchicalNSW : public AlgorithmInterface<dist_t> {
         const std::string &location,
         bool nmslib = false,
         size_t max_elements = 0,
-        bool allow_replace_deleted = false)
+        bool allow_replace_deleted = false,
+        size_t num_threads = 0)
         : allow_replace_deleted_(allow_replace_deleted) {
-        loadIndex(location, s, max_elements);
+        loadIndex(location, s, max_elements, num_threads);
     }
 
 
@@ -96,7 +394,8 @@ class HierarchicalNSW : public AlgorithmInterface<dist_t> {
         : label_op_locks_(MAX_LABEL_OPERATION_LOCKS),
             link_list_locks_(max_elements),
             element_levels_(max_elements),
-            allow_replace_deleted_(allow_replace_deleted) {
+            allow_replace_deleted_(allow_replace_deleted),
+            element_modified_(max_elements) {
         max_elements_ = max_elements;
         num_deleted_ = 0;
         data_size_ = s->get_data_size();
@@ -114,7 +413,7 @@ class HierarchicalNSW : public AlgorithmInterface<dist_t> {
         ef_construction_ = std::max(ef_construction, M_);
         ef_ = 10;
 
-        level_generator_.seed(random_seed);
+        random_seed_ = random_seed;
         update_probability_generator_.seed(random_seed + 1);
 
         size_links_level0_ = maxM0_ * sizeof(tableint) + sizeof(linklistsizeint);
@@ -123,17 +422,15 @@ class HierarchicalNSW : public AlgorithmInterface<dist_t> {
         label_offset_ = size_links_level0_ + data_size_;
         offsetLevel0_ = 0;
 
-        data_level0_memory_ = (char *) malloc(max_elements_ * size_data_per_element_);
-        if (data_level0_memory_ == nullptr)
-            throw std::runtime_error("Not enough memory");
+        initLevel0Storage();
+        reserveLevel0(max_elements_);
 
         cur_element_count = 0;
 
         visited_list_pool_ = std::unique_ptr<VisitedListPool>(new VisitedListPool(1, max_elements));
 
         // initializations for special treatment of the first node
-        enterpoint_node_ = -1;
-        maxlevel_ = -1;
+        setEntryPoint(-1, -1);
 
         linkLists_ = (char **) malloc(sizeof(void *) * max_elements_);
         if (linkLists_ == nullptr)
@@ -149,12 +446,17 @@ class HierarchicalNSW : public AlgorithmInterface<dist_t> {
     }
 
     void clear() {
-        free(data_level0_memory_);
-        data_level0_memory_ = nullptr;
-        for (tableint i = 0; i < cur_element_count; i++) {
-            if (element_levels_[i] > 0)
-                free(linkLists_[i]);
-        }
+        level0_store_.clear();
+        data_store_.clear();
+        label_store_.clear();
+        separate_storage_ = false;
+        aligned_layout_ = false;
+        links_compressed_ = false;
+        std::vector<uint8_t>().swap(compressed_links_);
+        std::vector<size_t>().swap(compressed_block_offsets_);
+        std::vector<uint16_t>().swap(compressed_link_offsets_);
+        link_list_arena_.clear();
+        frozen_ = false;
         free(linkLists_);
         linkLists_ = nullptr;
         cur_element_count = 0;
@@ -170,6 +472,19 @@ class HierarchicalNSW : public AlgorithmInterface<dist_t> {
     };
 
 
+    /*
+    * Per-thread working memory for the searchKnn overload that writes into caller-provided buffers. The candidate
+    * pools and visited list keep their capacity between queries, so once they have grown to fit ef, searching does
+    * no heap allocation. A SearchScratch may be reused with any index, but not by two threads at once.
+    */
+    struct SearchScratch {
+        std::vector<std::pair<dist_t, tableint>> top_candidates;
+        std::vector<std::pair<dist_t, tableint>> candidate_set;
+        std::unique_ptr<VisitedList> visited_list;
+        std::vector<linklistsizeint> links;  // level 0 links decoded from a compressed index
+    };
+
+
     void setEf(size_t ef) {
         ef_ = ef;
     }
@@ -182,34 +497,149 @@ class HierarchicalNSW : public AlgorithmInterface<dist_t> {
     }
 
 
+    // sets up empty level 0 storage in the layout given by separate_storage_
+    void initLevel0Storage() {
+        if (separate_storage_) {
+            level0_store_.init(layoutSize(size_links_level0_));
+            data_store_.init(layoutSize(data_size_));
+            label_store_.init(sizeof(labeltype));
+        } else {
+            level0_store_.init(size_data_per_element_);
+            data_store_.clear();
+            label_store_.clear();
+        }
+    }
+
+
+    // size rounded up to LAYOUT_ALIGNMENT if aligned_layout_ is set
+    size_t layoutSize(size_t size) const {
+        if (!aligned_layout_)
+            return size;
+        return (size + LAYOUT_ALIGNMENT - 1) & ~(LAYOUT_ALIGNMENT - 1);
+    }
+
+
+    // makes room in level 0 for max_elements elements, without moving any already stored
+    void reserveLevel0(size_t max_elements) {
+        level0_store_.reserve(max_elements);
+        if (separate_storage_) {
+            data_store_.reserve(max_elements);
+            label_store_.reserve(max_elements);
+        }
+    }
+
+
+    // the start of the level 0 record of an element: its links, then (unless separate_storage_) data and label
+    inline char *getElementPtr(tableint internal_id) const {
+        return level0_store_.get(internal_id);
+    }
+
+
     inline labeltype getExternalLabel(tableint internal_id) const {
         labeltype return_label;
-        memcpy(&return_label, (data_level0_memory_ + internal_id * size_data_per_element_ + label_offset_), sizeof(labeltype));
+        memcpy(&return_label, getExternalLabeLp(internal_id), sizeof(labeltype));
         return return_label;
     }
 
 
     inline void setExternalLabel(tableint internal_id, labeltype label) const {
-        memcpy((data_level0_memory_ + internal_id * size_data_per_element_ + label_offset_), &label, sizeof(labeltype));
+        memcpy(getExternalLabeLp(internal_id), &label, sizeof(labeltype));
     }
 
 
     inline labeltype *getExternalLabeLp(tableint internal_id) const {
-        return (labeltype *) (data_level0_memory_ + internal_id * size_data_per_element_ + label_offset_);
+        if (separate_storage_)
+            return (labeltype *) label_store_.get(internal_id);
+        return (labeltype *) (getElementPtr(internal_id) + label_offset_);
     }
 
 
     inline char *getDataByInternalId(tableint internal_id) const {
-        return (data_level0_memory_ + internal_id * size_data_per_element_ + offsetData_);
+        if (separate_storage_)
+            return data_store_.get(internal_id);
+        return (getElementPtr(internal_id) + offsetData_);
+    }
+
+
+    // writes the level 0 record of an element as it is laid out in a saved index, whatever the storage layout
+    template<typename Output>
+    void writeElement(Output &output, tableint internal_id) const {
+        if (!separate_storage_) {
+            writeBinaryBytes(output, getElementPtr(internal_id), size_data_per_element_);
+            return;
+        }
+        static const char padding[LAYOUT_ALIGNMENT] = {};
+        auto write_padding = [&](size_t size) {
+            for (; size > 0; size -= std::min(size, (size_t) LAYOUT_ALIGNMENT))
+                writeBinaryBytes(output, padding, std::min(size, (size_t) LAYOUT_ALIGNMENT));
+        };
+        if (links_compressed_) {
+            std::vector<linklistsizeint> links(size_links_level0_ / sizeof(linklistsizeint), 0);
+            decodeLinks(internal_id, links.data());
+            writeBinaryBytes(output, (const char *) links.data(), size_links_level0_);
+        } else {
+            writeBinaryBytes(output, getElementPtr(internal_id), size_links_level0_);
+        }
+        write_padding(offsetData_ - size_links_level0_);
+        writeBinaryBytes(output, getDataByInternalId(internal_id), data_size_);
+        write_padding(label_offset_ - offsetData_ - data_size_);
+        writeBinaryBytes(output, (const char *) getExternalLabeLp(internal_id), sizeof(labeltype));
+        write_padding(size_data_per_element_ - label_offset_ - sizeof(labeltype));
+    }
+
+
+    // the inverse of writeElement: sets the level 0 record of an element from a record as laid out in a saved index
+    void readElement(tableint internal_id, const char *record) {
+        if (!separate_storage_) {
+            memcpy(getElementPtr(internal_id), record, size_data_per_element_);
+            return;
+        }
+        memcpy(getElementPtr(internal_id), record, size_links_level0_);
+        memcpy(getDataByInternalId(internal_id), record + offsetData_, data_size_);
+        memcpy(getExternalLabeLp(internal_id), record + label_offset_, sizeof(labeltype));
+    }
+
+
+    static uint64_t mixBits(uint64_t x) {
+        x += 0x9e3779b97f4a7c15;
+        x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9;
+        x = (x ^ (x >> 27)) * 0x94d049bb133111eb;
+        return x ^ (x >> 31);
+    }
+
+
+    /*
+    * The level of the element with the given label. Rather than drawing from one generator shared by the
+    * inserting threads, the uniform number is a hash of the seed and the label, so threads need no
+    * synchronization, and the levels only depend on the seed and labels, not on the order of insertion.
+    */
+    int getRandomLevel(labeltype label, double reverse_size) const {
+        uint64_t bits = mixBits(mixBits(random_seed_) ^ label);
+        double r = ((bits >> 11) + 1) * (1.0 / 9007199254740992.0);  // in (0, 1]
+        return (int) (-log(r) * reverse_size);
     }
 
 
-    int getRandomLevel(double reverse_size) {
-        std::uniform_real_distribution<double> distribution(0.0, 1.0);
-        double r = -log(distribution(level_generator_)) * reverse_size;
-        return (int) r;
+    static uint64_t packEntryPoint(tableint id, int level) {
+        return ((uint64_t) (uint32_t) level << 32) | id;
     }
 
+
+    static EntryPoint unpackEntryPoint(uint64_t packed) {
+        return EntryPoint{(tableint) packed, (int) (uint32_t) (packed >> 32)};
+    }
+
+
+    EntryPoint getEntryPoint() const {
+        return unpackEntryPoint(entry_point_.load(std::memory_order_acquire));
+    }
+
+
+    void setEntryPoint(tableint id, int level) {
+        entry_point_.store(packEntryPoint(id, level), std::memory_order_release);
+    }
+
+
     size_t getMaxElements() {
         return max_elements_;
     }
@@ -252,7 +682,7 @@ class HierarchicalNSW : public AlgorithmInterface<dist_t> {
 
             tableint curNodeNum = curr_el_pair.second;
 
-            std::unique_lock <std::mutex> lock(link_list_locks_[curNodeNum]);
+            std::unique_lock <ElementLock> lock(link_list_locks_[curNodeNum]);
 
             int *data;  // = (int *)(linkList0_ + curNodeNum * size_links_per_element0_);
             if (layer == 0) {
@@ -320,6 +750,13 @@ class HierarchicalNSW : public AlgorithmInterface<dist_t> {
 
         std::priority_queue<std::pair<dist_t, tableint>, std::vector<std::pair<dist_t, tableint>>, CompareByFirst> top_candidates;
         std::priority_queue<std::pair<dist_t, tableint>, std::vector<std::pair<dist_t, tableint>>, CompareByFirst> candidate_set;
+        /*
+        * The buffer compressed level 0 links are decoded into. It is kept per thread, as visited lists are kept in a
+        * pool, so that searching a compressed index doesn't allocate per query.
+        */
+        static thread_local std::vector<linklistsizeint> link_buffer;
+        if (links_compressed_ && link_buffer.size() < maxM0_ + 2)
+            link_buffer.resize(maxM0_ + 2);
 
         dist_t lowerBound;
         if (bare_bone_search || 
@@ -359,7 +796,7 @@ class HierarchicalNSW : public AlgorithmInterface<dist_t> {
             candidate_set.pop();
 
             tableint current_node_id = current_node_pair.second;
-            int *data = (int *) get_linklist0(current_node_id);
+            int *data = (int *) getLevel0Links(current_node_id, link_buffer.data());
             size_t size = getListCount((linklistsizeint*)data);
 //                bool cur_node_deleted = isMarkedDeleted(current_node_id);
             if (collect_metrics) {
@@ -370,7 +807,7 @@ class HierarchicalNSW : public AlgorithmInterface<dist_t> {
 #ifdef USE_SSE
             _mm_prefetch((char *) (visited_array + *(data + 1)), _MM_HINT_T0);
             _mm_prefetch((char *) (visited_array + *(data + 1) + 64), _MM_HINT_T0);
-            _mm_prefetch(data_level0_memory_ + (*(data + 1)) * size_data_per_element_ + offsetData_, _MM_HINT_T0);
+            _mm_prefetch(getDataByInternalId(*(data + 1)), _MM_HINT_T0);
             _mm_prefetch((char *) (data + 2), _MM_HINT_T0);
 #endif
 
@@ -379,8 +816,7 @@ class HierarchicalNSW : public AlgorithmInterface<dist_t> {
 //                    if (candidate_id == 0) continue;
 #ifdef USE_SSE
                 _mm_prefetch((char *) (visited_array + *(data + j + 1)), _MM_HINT_T0);
-                _mm_prefetch(data_level0_memory_ + (*(data + j + 1)) * size_data_per_element_ + offsetData_,
-                                _MM_HINT_T0);  ////////////
+                _mm_prefetch(getDataByInternalId(*(data + j + 1)), _MM_HINT_T0);  ////////////
 #endif
                 if (!(visited_array[candidate_id] == visited_array_tag)) {
                     visited_array[candidate_id] = visited_array_tag;
@@ -398,9 +834,8 @@ class HierarchicalNSW : public AlgorithmInterface<dist_t> {
                     if (flag_consider_candidate) {
                         candidate_set.emplace(-dist, candidate_id);
 #ifdef USE_SSE
-                        _mm_prefetch(data_level0_memory_ + candidate_set.top().second * size_data_per_element_ +
-                                        offsetLevel0_,  ///////////
-                                        _MM_HINT_T0);  ////////////////////////
+                        if (!links_compressed_)
+                            _mm_prefetch(getElementPtr(candidate_set.top().second) + offsetLevel0_, _MM_HINT_T0);
 #endif
 
                         if (bare_bone_search || 
@@ -440,6 +875,112 @@ class HierarchicalNSW : public AlgorithmInterface<dist_t> {
     }
 
 
+    // as searchBaseLayerST without a stop condition, but keeping the candidates as heaps in the scratch vectors
+    template <bool bare_bone_search = true>
+    void searchBaseLayerScratch(
+        tableint ep_id,
+        const void *data_point,
+        size_t ef,
+        SearchScratch &scratch,
+        BaseFilterFunctor* isIdAllowed = nullptr) const {
+        if (!scratch.visited_list || scratch.visited_list->numelements != max_elements_) {
+            scratch.visited_list.reset(new VisitedList(max_elements_));
+        }
+        VisitedList *vl = scratch.visited_list.get();
+        vl->reset();
+        vl_type *visited_array = vl->mass;
+        vl_type visited_array_tag = vl->curV;
+
+        std::vector<std::pair<dist_t, tableint>> &top_candidates = scratch.top_candidates;
+        std::vector<std::pair<dist_t, tableint>> &candidate_set = scratch.candidate_set;
+        top_candidates.clear();
+        candidate_set.clear();
+        if (links_compressed_ && scratch.links.size() < maxM0_ + 2)
+            scratch.links.resize(maxM0_ + 2);
+        CompareByFirst compare;
+
+        dist_t lowerBound;
+        if (bare_bone_search ||
+            (!isMarkedDeleted(ep_id) && ((!isIdAllowed) || (*isIdAllowed)(getExternalLabel(ep_id))))) {
+            dist_t dist = fstdistfunc_(data_point, getDataByInternalId(ep_id), dist_func_param_);
+            lowerBound = dist;
+            top_candidates.emplace_back(dist, ep_id);
+            candidate_set.emplace_back(-dist, ep_id);
+        } else {
+            lowerBound = std::numeric_limits<dist_t>::max();
+            candidate_set.emplace_back(-lowerBound, ep_id);
+        }
+
+        visited_array[ep_id] = visited_array_tag;
+
+        while (!candidate_set.empty()) {
+            std::pair<dist_t, tableint> current_node_pair = candidate_set.front();
+            dist_t candidate_dist = -current_node_pair.first;
+            if (candidate_dist > lowerBound && (bare_bone_search || top_candidates.size() == ef)) {
+                break;
+            }
+            std::pop_heap(candidate_set.begin(), candidate_set.end(), compare);
+            candidate_set.pop_back();
+
+            tableint current_node_id = current_node_pair.second;
+            int *data = (int *) getLevel0Links(current_node_id, scratch.links.data());
+            size_t size = getListCount((linklistsizeint*)data);
+
+#ifdef USE_SSE
+            _mm_prefetch((char *) (visited_array + *(data + 1)), _MM_HINT_T0);
+            _mm_prefetch((char *) (visited_array + *(data + 1) + 64), _MM_HINT_T0);
+            _mm_prefetch(getDataByInternalId(*(data + 1)), _MM_HINT_T0);
+            _mm_prefetch((char *) (data + 2), _MM_HINT_T0);
+#endif
+
+            for (size_t j = 1; j <= size; j++) {
+                int candidate_id = *(data + j);
+#ifdef USE_SSE
+                _mm_prefetch((char *) (visited_array + *(data + j + 1)), _MM_HINT_T0);
+                _mm_prefetch(getDataByInternalId(*(data + j + 1)), _MM_HINT_T0);
+#endif
+                if (visited_array[candidate_id] == visited_array_tag) continue;
+                visited_array[candidate_id] = visited_array_tag;
+
+                dist_t dist = fstdistfunc_(data_point, getDataByInternalId(candidate_id), dist_func_param_);
+                if (top_candidates.size() < ef || lowerBound > dist) {
+                    candidate_set.emplace_back(-dist, candidate_id);
+                    std::push_heap(candidate_set.begin(), candidate_set.end(), compare);
+
+                    if (bare_bone_search ||
+                        (!isMarkedDeleted(candidate_id) && ((!isIdAllowed) || (*isIdAllowed)(getExternalLabel(candidate_id))))) {
+                        top_candidates.emplace_back(dist, candidate_id);
+                        std::push_heap(top_candidates.begin(), top_candidates.end(), compare);
+                    }
+
+                    while (top_candidates.size() > ef) {
+                        std::pop_heap(top_candidates.begin(), top_candidates.end(), compare);
+                        top_candidates.pop_back();
+                    }
+
+                    if (!top_candidates.empty())
+                        lowerBound = top_candidates.front().first;
+                }
+            }
+        }
+    }
+
+
+    /*
+    * Distances between the candidates are recomputed here rather than cached. Counting distance calls while
+    * building 50000 random items (dim 32, ef_construction 200, one thread) gave:
+    *
+    *                                          M = 16    M = 48
+    *   searching for candidates               70.9%     84.7%
+    *   pruning the new item's candidates       6.6%     12.7%
+    *   pruning overflowing neighbor lists     21.0%      2.4%
+    *   distance from an overflowing item to
+    *   its existing links                      1.5%      0.1%
+    *
+    * Storing a distance with each link would only remove the last row, at a cost of maxM0_ distances of memory
+    * per item. The pairs compared here are between candidates, which per-link storage doesn't hold, and a
+    * per-thread cache of them answered only 4-5% of lookups.
+    */
     void getNeighborsByHeuristic2(
         std::priority_queue<std::pair<dist_t, tableint>, std::vector<std::pair<dist_t, tableint>>, CompareByFirst> &top_candidates,
         const size_t M) {
@@ -484,12 +1025,78 @@ class HierarchicalNSW : public AlgorithmInterface<dist_t> {
 
 
     linklistsizeint *get_linklist0(tableint internal_id) const {
-        return (linklistsizeint *) (data_level0_memory_ + internal_id * size_data_per_element_ + offsetLevel0_);
+        return (linklistsizeint *) (getElementPtr(internal_id) + offsetLevel0_);
+    }
+
+
+    /*
+    * The level 0 links of an element. If they are compressed, they are decoded into buffer, which must have room
+    * for maxM0_ + 2 values, in the same layout as an uncompressed list.
+    */
+    inline linklistsizeint *getLevel0Links(tableint internal_id, linklistsizeint *buffer) const {
+        if (!links_compressed_)
+            return get_linklist0(internal_id);
+        decodeLinks(internal_id, buffer);
+        return buffer;
+    }
+
+
+    static inline void writeVarint(std::vector<uint8_t> &output, size_t value) {
+        while (value >= 0x80) {
+            output.push_back((uint8_t) (value | 0x80));
+            value >>= 7;
+        }
+        output.push_back((uint8_t) value);
+    }
+
+
+    static inline size_t readVarint(const uint8_t *&input) {
+        size_t value = 0;
+        for (int shift = 0;; shift += 7) {
+            uint8_t byte = *input++;
+            value |= (size_t) (byte & 0x7f) << shift;
+            if (!(byte & 0x80))
+                return value;
+        }
+    }
+
+
+    // compressed element: its flags byte, its number of links, then the sorted links as varint deltas
+    void encodeLinks(tableint internal_id, std::vector<uint8_t> &output) const {
+        linklistsizeint *ll = get_linklist0(internal_id);
+        size_t size = getListCount(ll);
+        tableint *links = (tableint *) (ll + 1);
+        std::vector<tableint> sorted(links, links + size);
+        std::sort(sorted.begin(), sorted.end());
+        output.push_back(((unsigned char *) ll)[2]);
+        writeVarint(output, size);
+        tableint previous = 0;
+        for (tableint link : sorted) {
+            writeVarint(output, link - previous);
+            previous = link;
+        }
+    }
+
+
+    const uint8_t *getCompressedLinks(tableint internal_id) const {
+        return compressed_links_.data() + compressed_block_offsets_[internal_id >> compressed_block_shift_] +
+               compressed_link_offsets_[internal_id];
     }
 
 
-    linklistsizeint *get_linklist0(tableint internal_id, char *data_level0_memory_) const {
-        return (linklistsizeint *) (data_level0_memory_ + internal_id * size_data_per_element_ + offsetLevel0_);
+    void decodeLinks(tableint internal_id, linklistsizeint *buffer) const {
+        const uint8_t *input = getCompressedLinks(internal_id);
+        unsigned char flags = *input++;
+        size_t size = readVarint(input);
+        *buffer = 0;
+        setListCount(buffer, size);
+        ((unsigned char *) buffer)[2] = flags;
+        tableint *links = (tableint *) (buffer + 1);
+        tableint link = 0;
+        for (size_t j = 0; j < size; j++) {
+            link += readVarint(input);
+            links[j] = link;
+        }
     }
 
 
@@ -524,35 +1131,59 @@ class HierarchicalNSW : public AlgorithmInterface<dist_t> {
         tableint next_closest_entry_point = selectedNeighbors.back();
 
         {
-            // lock only during the update
-            // because during the addition the lock for cur_c is already acquired
-            std::unique_lock <std::mutex> lock(link_list_locks_[cur_c], std::defer_lock);
-            if (isUpdate) {
-                lock.lock();
-            }
+            // addPoint doesn't hold the lock for cur_c while it searches, so that it never waits for another
+            // element's lock while holding its own
+            std::unique_lock <ElementLock> lock(link_list_locks_[cur_c]);
             linklistsizeint *ll_cur;
             if (level == 0)
                 ll_cur = get_linklist0(cur_c);
             else
                 ll_cur = get_linklist(cur_c, level);
 
-            if (*ll_cur && !isUpdate) {
-                throw std::runtime_error("The newly inserted element should have blank link list");
-            }
-            setListCount(ll_cur, selectedNeighbors.size());
-            tableint *data = (tableint *) (ll_cur + 1);
-            for (size_t idx = 0; idx < selectedNeighbors.size(); idx++) {
-                if (data[idx] && !isUpdate)
-                    throw std::runtime_error("Possible memory corruption");
-                if (level > element_levels_[selectedNeighbors[idx]])
-                    throw std::runtime_error("Trying to make a link on a non-existent level");
-
-                data[idx] = selectedNeighbors[idx];
+            size_t sz_link_list_cur = getListCount(ll_cur);
+            if (sz_link_list_cur && !isUpdate) {
+                // another thread started a search at this level from cur_c and linked to it first: keep
+                // those links, pruning the union the same way as a full neighbour list below
+                tableint *data = (tableint *) (ll_cur + 1);
+                std::vector<tableint> merged(data, data + sz_link_list_cur);
+                for (tableint neighbor : selectedNeighbors) {
+                    if (std::find(merged.begin(), merged.end(), neighbor) == merged.end())
+                        merged.push_back(neighbor);
+                }
+                if (merged.size() > Mcurmax) {
+                    std::priority_queue<std::pair<dist_t, tableint>, std::vector<std::pair<dist_t, tableint>>, CompareByFirst> candidates;
+                    for (tableint neighbor : merged) {
+                        candidates.emplace(
+                                fstdistfunc_(getDataByInternalId(neighbor), getDataByInternalId(cur_c), dist_func_param_),
+                                neighbor);
+                    }
+                    getNeighborsByHeuristic2(candidates, Mcurmax);
+                    merged.clear();
+                    while (candidates.size() > 0) {
+                        merged.push_back(candidates.top().second);
+                        candidates.pop();
+                    }
+                }
+                setListCount(ll_cur, merged.size());
+                element_modified_[cur_c] = 1;
+                std::copy(merged.begin(), merged.end(), data);
+            } else {
+                setListCount(ll_cur, selectedNeighbors.size());
+                element_modified_[cur_c] = 1;
+                tableint *data = (tableint *) (ll_cur + 1);
+                for (size_t idx = 0; idx < selectedNeighbors.size(); idx++) {
+                    if (data[idx] && !isUpdate)
+                        throw std::runtime_error("Possible memory corruption");
+                    if (level > element_levels_[selectedNeighbors[idx]])
+                        throw std::runtime_error("Trying to make a link on a non-existent level");
+
+                    data[idx] = selectedNeighbors[idx];
+                }
             }
         }
 
         for (size_t idx = 0; idx < selectedNeighbors.size(); idx++) {
-            std::unique_lock <std::mutex> lock(link_list_locks_[selectedNeighbors[idx]]);
+            std::unique_lock <ElementLock> lock(link_list_locks_[selectedNeighbors[idx]]);
 
             linklistsizeint *ll_other;
             if (level == 0)
@@ -569,6 +1200,7 @@ class HierarchicalNSW : public AlgorithmInterface<dist_t> {
             if (level > element_levels_[selectedNeighbors[idx]])
                 throw std::runtime_error("Trying to make a link on a non-existent level");
 
+            element_modified_[selectedNeighbors[idx]] = 1;
             tableint *data = (tableint *) (ll_other + 1);
 
             bool is_cur_c_present = false;
@@ -631,20 +1263,34 @@ class HierarchicalNSW : public AlgorithmInterface<dist_t> {
 
 
     void resizeIndex(size_t new_max_elements) {
+        checkNotFrozen();
+        std::unique_lock <WriteBarrier> lock_write(write_barrier_);
         if (new_max_elements < cur_element_count)
             throw std::runtime_error("Cannot resize, max element is less than the current number of elements");
 
         visited_list_pool_.reset(new VisitedListPool(1, new_max_elements));
 
         element_levels_.resize(new_max_elements);
+        element_modified_.resize(new_max_elements);
+
+        std::vector<ElementLock>(new_max_elements).swap(link_list_locks_);
 
-        std::vector<std::mutex>(new_max_elements).swap(link_list_locks_);
+        if (dense_labels_) {
+            for (size_t label = new_max_elements; label < max_elements_; label++) {
+                if (dense_label_lookup_[label].load(std::memory_order_relaxed) != NO_INTERNAL_ID)
+                    throw std::runtime_error("Cannot resize, a label is not less than the new max element");
+            }
+            std::vector<std::atomic<tableint>> dense_label_lookup_new(new_max_elements);
+            for (size_t label = 0; label < new_max_elements; label++) {
+                tableint internal_id = label < max_elements_ ?
+                    dense_label_lookup_[label].load(std::memory_order_relaxed) : NO_INTERNAL_ID;
+                dense_label_lookup_new[label].store(internal_id, std::memory_order_relaxed);
+            }
+            dense_label_lookup_.swap(dense_label_lookup_new);
+        }
 
-        // Reallocate base layer
-        char * data_level0_memory_new = (char *) realloc(data_level0_memory_, new_max_elements * size_data_per_element_);
-        if (data_level0_memory_new == nullptr)
-            throw std::runtime_error("Not enough memory: resizeIndex failed to allocate base layer");
-        data_level0_memory_ = data_level0_memory_new;
+        // Extend the base layer: existing chunks are kept, so this never copies the whole layer
+        reserveLevel0(new_max_elements);
 
         // Reallocate all other layers
         char ** linkLists_new = (char **) realloc(linkLists_, sizeof(void *) * new_max_elements);
@@ -655,24 +1301,311 @@ class HierarchicalNSW : public AlgorithmInterface<dist_t> {
         max_elements_ = new_max_elements;
     }
 
-    size_t indexFileSize() const {
-        size_t size = 0;
-        size += sizeof(offsetLevel0_);
-        size += sizeof(max_elements_);
-        size += sizeof(cur_element_count);
-        size += sizeof(size_data_per_element_);
-        size += sizeof(label_offset_);
-        size += sizeof(offsetData_);
-        size += sizeof(maxlevel_);
-        size += sizeof(enterpoint_node_);
-        size += sizeof(maxM_);
 
-        size += sizeof(maxM0_);
-        size += sizeof(M_);
-        size += sizeof(mult_);
-        size += sizeof(ef_construction_);
+    /*
+    * Renumbers the elements so that elements which are neighbors in the level 0 graph are also close together in
+    * memory, which makes searches more cache-friendly. The new order is a breadth-first traversal of level 0 from
+    * the entry point (continuing from the first unvisited element if the graph is disconnected). Labels are not
+    * changed. The index must not otherwise be used while it is reordered, and level 0 is copied, so temporarily
+    * needs twice the memory.
+    */
+    void reorder(size_t num_threads = 0) {
+        checkLinksNotCompressed();
+        std::unique_lock <WriteBarrier> lock_write(write_barrier_);
+        const size_t element_count = cur_element_count;
+        if (element_count == 0)
+            return;
 
-        size += cur_element_count * size_data_per_element_;
+        std::vector<tableint> order;  // the old id of each new id
+        order.reserve(element_count);
+        std::vector<tableint> new_ids(element_count, (tableint) NO_INTERNAL_ID);
+        auto visit = [&](tableint internal_id) {
+            new_ids[internal_id] = order.size();
+            order.push_back(internal_id);
+        };
+        EntryPoint entry_point = getEntryPoint();
+        visit(entry_point.id);
+        size_t next_unvisited = 0;
+        for (size_t head = 0; head < element_count; head++) {
+            if (head == order.size()) {
+                while (new_ids[next_unvisited] != NO_INTERNAL_ID)
+                    next_unvisited++;
+                visit(next_unvisited);
+            }
+            linklistsizeint *ll = get_linklist0(order[head]);
+            size_t size = getListCount(ll);
+            tableint *links = (tableint *) (ll + 1);
+            for (size_t j = 0; j < size; j++) {
+                if (new_ids[links[j]] == NO_INTERNAL_ID)
+                    visit(links[j]);
+            }
+        }
+
+        char **new_link_lists = (char **) malloc(sizeof(void *) * max_elements_);
+        if (new_link_lists == nullptr)
+            throw std::runtime_error("Not enough memory: reorder failed to allocate linklists");
+        ChunkedStore old_level0, old_data, old_labels;
+        old_level0.swap(level0_store_);
+        old_data.swap(data_store_);
+        old_labels.swap(label_store_);
+        try {
+            initLevel0Storage();
+            reserveLevel0(old_level0.capacity_);
+        } catch (...) {
+            level0_store_.swap(old_level0);
+            data_store_.swap(old_data);
+            label_store_.swap(old_labels);
+            free(new_link_lists);
+            throw;
+        }
+        char **old_link_lists = linkLists_;
+        linkLists_ = new_link_lists;
+        std::vector<int> old_levels(element_levels_);
+
+        auto worker = [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; i++) {
+                tableint old_id = order[i];
+                memcpy(getElementPtr(i), old_level0.get(old_id), level0_store_.stride_);
+                if (separate_storage_) {
+                    memcpy(getDataByInternalId(i), old_data.get(old_id), data_size_);
+                    memcpy(getExternalLabeLp(i), old_labels.get(old_id), sizeof(labeltype));
+                }
+                linkLists_[i] = old_link_lists[old_id];
+                element_levels_[i] = old_levels[old_id];
+                for (int level = 0; level <= element_levels_[i]; level++) {
+                    linklistsizeint *ll = get_linklist_at_level(i, level);
+                    size_t size = getListCount(ll);
+                    tableint *links = (tableint *) (ll + 1);
+                    for (size_t j = 0; j < size; j++) {
+                        links[j] = new_ids[links[j]];
+                    }
+                }
+            }
+        };
+        pforr::parallel_for(0, element_count, worker, num_threads);
+
+        free(old_link_lists);
+        setEntryPoint(new_ids[entry_point.id], entry_point.level);
+
+        // rebuild everything else which refers to internal ids
+        if (dense_labels_) {
+            for (size_t i = 0; i < element_count; i++)
+                dense_label_lookup_[getExternalLabel(i)].store(i, std::memory_order_relaxed);
+        } else {
+            for (size_t i = 0; i < element_count; i++)
+                label_lookup_[getExternalLabel(i)] = i;
+        }
+        deleted_elements.clear();
+        if (allow_replace_deleted_) {
+            for (size_t i = 0; i < element_count; i++) {
+                if (isMarkedDeleted(i))
+                    deleted_elements.insert(i);
+            }
+        }
+        // every element has moved, so the next incremental save must be a full one
+        checkpoint_location_.clear();
+    }
+
+
+    /*
+    * Moves the data and labels of level 0 out of the link records into arrays of their own, so that following
+    * links and computing distances each read only the memory they need. Saved indexes use the usual interleaved
+    * layout whichever is used in memory, and are loaded interleaved.
+    */
+    void useSeparateStorage(size_t num_threads = 0) {
+        std::unique_lock <WriteBarrier> lock_write(write_barrier_);
+        if (separate_storage_)
+            return;
+        if (offsetLevel0_ != 0)
+            throw std::runtime_error("Separate storage needs the links at the start of level 0 records");
+
+        ChunkedStore interleaved;
+        interleaved.swap(level0_store_);
+        separate_storage_ = true;
+        try {
+            initLevel0Storage();
+            reserveLevel0(interleaved.capacity_);
+        } catch (...) {
+            separate_storage_ = false;
+            initLevel0Storage();
+            level0_store_.swap(interleaved);
+            throw;
+        }
+
+        auto worker = [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; i++)
+                readElement(i, interleaved.get(i));
+        };
+        pforr::parallel_for(0, cur_element_count, worker, num_threads);
+    }
+
+
+    /*
+    * Pads the level 0 record of each element so that it starts on a cache line and its data starts on the next
+    * one after its links, which keeps each vector in the fewest cache lines and aligned for vector loads. Saved
+    * indexes record the padded layout in their header, which hnswlib reads. Best called before adding items,
+    * as converting an existing index copies level 0.
+    */
+    void useAlignedLayout(size_t num_threads = 0) {
+        checkLinksNotCompressed();
+        std::unique_lock <WriteBarrier> lock_write(write_barrier_);
+        if (aligned_layout_)
+            return;
+        if (offsetLevel0_ != 0)
+            throw std::runtime_error("Aligned layout needs the links at the start of level 0 records");
+
+        ChunkedStore old_level0, old_data, old_labels;
+        old_level0.swap(level0_store_);
+        old_data.swap(data_store_);
+        old_labels.swap(label_store_);
+        const size_t old_offset_data = offsetData_, old_label_offset = label_offset_;
+        const size_t old_size_data_per_element = size_data_per_element_;
+        aligned_layout_ = true;
+        offsetData_ = layoutSize(size_links_level0_);
+        label_offset_ = offsetData_ + data_size_;
+        size_data_per_element_ = layoutSize(label_offset_ + sizeof(labeltype));
+        try {
+            initLevel0Storage();
+            reserveLevel0(old_level0.capacity_);
+        } catch (...) {
+            aligned_layout_ = false;
+            offsetData_ = old_offset_data;
+            label_offset_ = old_label_offset;
+            size_data_per_element_ = old_size_data_per_element;
+            level0_store_.swap(old_level0);
+            data_store_.swap(old_data);
+            label_store_.swap(old_labels);
+            throw;
+        }
+
+        auto worker = [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; i++) {
+                const char *old_record = old_level0.get(i);
+                memset(getElementPtr(i), 0, level0_store_.stride_);
+                memcpy(getElementPtr(i), old_record, size_links_level0_);
+                memcpy(getDataByInternalId(i), separate_storage_ ? old_data.get(i) : old_record + old_offset_data,
+                       data_size_);
+                memcpy(getExternalLabeLp(i), separate_storage_ ? old_labels.get(i) : old_record + old_label_offset,
+                       sizeof(labeltype));
+            }
+        };
+        pforr::parallel_for(0, cur_element_count, worker, num_threads);
+        // the records have changed size, so the next incremental save must be a full one
+        checkpoint_location_.clear();
+    }
+
+
+    /*
+    * Makes the index read-only and compacts it for searching. The upper layers are packed into one block in
+    * element order, labels are looked up in an array (if they fit) and the memory used to coordinate changes
+    * (the element and label locks and the set of deleted elements available for replacement) is released.
+    * Adding, deleting or resizing afterwards throws. Searching and saving work as usual, and loading the saved
+    * index gives one which can be modified again.
+    */
+    void freeze() {
+        if (frozen_)
+            return;
+        useDenseLabels();
+
+        std::unique_lock <WriteBarrier> lock_write(write_barrier_);
+        size_t link_lists_size = 0;
+        for (size_t i = 0; i < cur_element_count; i++) {
+            link_lists_size += size_links_per_element_ * element_levels_[i];
+        }
+        LinkListArena packed;
+        char *block = link_lists_size > 0 ? packed.allocate(link_lists_size) : nullptr;
+        for (size_t i = 0; i < cur_element_count; i++) {
+            if (element_levels_[i] > 0) {
+                size_t size = size_links_per_element_ * element_levels_[i];
+                memcpy(block, linkLists_[i], size);
+                linkLists_[i] = block;
+                block += size;
+            }
+        }
+        link_list_arena_.swap(packed);
+
+        std::vector<ElementLock>().swap(link_list_locks_);
+        std::vector<std::mutex>().swap(label_op_locks_);
+        std::unordered_set<tableint>().swap(deleted_elements);
+        allow_replace_deleted_ = false;
+        frozen_ = true;
+    }
+
+
+    void checkNotFrozen() const {
+        if (frozen_)
+            throw std::runtime_error("The index is frozen and can't be modified");
+    }
+
+
+    /*
+    * Freezes the index and compresses the lists of links in level 0. Each list is sorted and stored as the
+    * varint encoded differences between consecutive ids, which after reorder are mostly small enough to fit in
+    * one byte, and decoded as it is searched. Level 0 then only holds the data and labels, as with
+    * useSeparateStorage. A compressed index is saved uncompressed.
+    */
+    void compressLinks(size_t num_threads = 0) {
+        freeze();
+        useSeparateStorage(num_threads);
+        std::unique_lock <WriteBarrier> lock_write(write_barrier_);
+        if (links_compressed_)
+            return;
+
+        // blocks of up to 64 elements, as long as the offsets within a block fit in 16 bits: an element takes at
+        // most a flags byte and a varint for each of its size and links
+        size_t max_encoded_size = 1 + 5 * (maxM0_ + 1);
+        size_t block_shift = 6;
+        while (block_shift > 0 && (max_encoded_size << block_shift) > 65536)
+            block_shift--;
+
+        std::vector<uint8_t> compressed;
+        std::vector<size_t> block_offsets((cur_element_count >> block_shift) + 1);
+        std::vector<uint16_t> offsets(cur_element_count);
+        compressed.reserve(cur_element_count * (size_links_level0_ / 2));
+        for (size_t i = 0; i < cur_element_count; i++) {
+            if ((i & ((1 << block_shift) - 1)) == 0)
+                block_offsets[i >> block_shift] = compressed.size();
+            offsets[i] = (uint16_t) (compressed.size() - block_offsets[i >> block_shift]);
+            encodeLinks(i, compressed);
+        }
+        compressed.shrink_to_fit();
+        compressed_links_.swap(compressed);
+        compressed_block_shift_ = block_shift;
+        compressed_block_offsets_.swap(block_offsets);
+        compressed_link_offsets_.swap(offsets);
+        level0_store_.clear();
+        links_compressed_ = true;
+    }
+
+
+    void checkLinksNotCompressed() const {
+        if (links_compressed_)
+            throw std::runtime_error("The index links are compressed and can't be rearranged");
+    }
+
+    size_t indexHeaderSize() const {
+        size_t size = 0;
+        size += sizeof(offsetLevel0_);
+        size += sizeof(max_elements_);
+        size += sizeof(cur_element_count);
+        size += sizeof(size_data_per_element_);
+        size += sizeof(label_offset_);
+        size += sizeof(offsetData_);
+        size += sizeof(EntryPoint::level);
+        size += sizeof(EntryPoint::id);
+        size += sizeof(maxM_);
+
+        size += sizeof(maxM0_);
+        size += sizeof(M_);
+        size += sizeof(mult_);
+        size += sizeof(ef_construction_);
+        return size;
+    }
+
+    size_t indexFileSize() const {
+        size_t size = indexHeaderSize();
+
+        size += cur_element_count * size_data_per_element_;
 
         for (size_t i = 0; i < cur_element_count; i++) {
             unsigned int linkListSize = element_levels_[i] > 0 ? size_links_per_element_ * element_levels_[i] : 0;
@@ -682,48 +1615,339 @@ class HierarchicalNSW : public AlgorithmInterface<dist_t> {
         return size;
     }
 
-    void saveIndex(const std::string &location) {
-        std::ofstream output(location, std::ios::binary);
-
+    template<typename Output>
+    void writeIndexHeader(Output &output, size_t element_count, EntryPoint entry_point) const {
         writeBinaryPOD(output, offsetLevel0_);
         writeBinaryPOD(output, max_elements_);
-        writeBinaryPOD(output, cur_element_count);
+        writeBinaryPOD(output, element_count);
         writeBinaryPOD(output, size_data_per_element_);
         writeBinaryPOD(output, label_offset_);
         writeBinaryPOD(output, offsetData_);
-        writeBinaryPOD(output, maxlevel_);
-        writeBinaryPOD(output, enterpoint_node_);
+        writeBinaryPOD(output, entry_point.level);
+        writeBinaryPOD(output, entry_point.id);
         writeBinaryPOD(output, maxM_);
 
         writeBinaryPOD(output, maxM0_);
         writeBinaryPOD(output, M_);
         writeBinaryPOD(output, mult_);
         writeBinaryPOD(output, ef_construction_);
+    }
+
+    // Output is either a std::ostream or a char * into a buffer of at least indexFileSize() bytes
+    template<typename Output>
+    void writeIndex(Output &output) const {
+        writeIndexHeader(output, cur_element_count, getEntryPoint());
 
-        output.write(data_level0_memory_, cur_element_count * size_data_per_element_);
+        if (separate_storage_) {
+            for (size_t i = 0; i < cur_element_count; i++)
+                writeElement(output, i);
+        } else {
+            level0_store_.forEachChunk(cur_element_count, [&](const char *chunk, size_t, size_t nelements) {
+                writeBinaryBytes(output, chunk, nelements * size_data_per_element_);
+            });
+        }
 
         for (size_t i = 0; i < cur_element_count; i++) {
             unsigned int linkListSize = element_levels_[i] > 0 ? size_links_per_element_ * element_levels_[i] : 0;
             writeBinaryPOD(output, linkListSize);
             if (linkListSize)
-                output.write(linkLists_[i], linkListSize);
+                writeBinaryBytes(output, linkLists_[i], linkListSize);
+        }
+    }
+
+    // removes the links to elements with ids of at least element_count from a link list
+    void dropLinksFrom(linklistsizeint *ll, size_t element_count) const {
+        size_t size = getListCount(ll);
+        tableint *links = (tableint *) (ll + 1);
+        size_t kept = 0;
+        for (size_t j = 0; j < size; j++) {
+            if (links[j] < element_count)
+                links[kept++] = links[j];
+        }
+        setListCount(ll, kept);
+    }
+
+
+    /*
+    * Writes the first element_count elements as a saved index with the given entry point while other threads
+    * may be adding and changing elements. Each element's lists are copied under its lock, and the links to
+    * elements added since are dropped. The caller must hold write_barrier_ shared.
+    */
+    void writeIndexSnapshot(std::ostream &output, size_t element_count, EntryPoint entry_point) {
+        // a frozen index can't change, and has no element locks
+        auto lock_element = [&](tableint internal_id) {
+            return frozen_ ? std::unique_lock <ElementLock>() : std::unique_lock <ElementLock>(link_list_locks_[internal_id]);
+        };
+
+        writeIndexHeader(output, element_count, entry_point);
+
+        std::vector<char> record(size_data_per_element_);
+        for (size_t i = 0; i < element_count; i++) {
+            {
+                auto lock = lock_element(i);
+                char *pos = record.data();
+                writeElement(pos, i);
+            }
+            dropLinksFrom((linklistsizeint *) record.data(), element_count);
+            writeBinaryBytes(output, record.data(), size_data_per_element_);
+        }
+
+        std::vector<char> link_lists;
+        for (size_t i = 0; i < element_count; i++) {
+            unsigned int linkListSize = element_levels_[i] > 0 ? size_links_per_element_ * element_levels_[i] : 0;
+            writeBinaryPOD(output, linkListSize);
+            if (!linkListSize)
+                continue;
+            link_lists.resize(linkListSize);
+            {
+                auto lock = lock_element(i);
+                memcpy(link_lists.data(), linkLists_[i], linkListSize);
+            }
+            for (int level = 0; level < element_levels_[i]; level++)
+                dropLinksFrom((linklistsizeint *) (link_lists.data() + level * size_links_per_element_), element_count);
+            writeBinaryBytes(output, link_lists.data(), linkListSize);
         }
+    }
+
+
+    /*
+    * Saves the index to location on a background thread. Modifications are blocked only while the element count
+    * and entry point are taken and the modified flags reset; the elements are then written straight from the
+    * index, without copying it, while searches, inserts and deletes go ahead. Operations which restructure the
+    * index, such as resizeIndex, reorder or freeze, wait until the file is written. An element changed while the
+    * file is being written may be saved in either state, but it is flagged as modified, so the next
+    * saveIndexIncremental saves it again. The index must outlive the returned future, which becomes ready when the
+    * file is written and rethrows any error from writing it.
+    * Until the checkpoint returned by the future is passed to commitCheckpoint, saveIndexIncremental does a
+    * full save, and no other save to location should be started.
+    */
+    std::future<IndexCheckpoint> saveIndexAsync(const std::string &location) {
+        bool remove_log = isIndexLog(indexLogLocation(location));
+        std::promise<void> started;
+        std::future<void> snapshot_taken = started.get_future();
+
+        auto future = std::async(std::launch::async, [this, location, remove_log, &started]() {
+            std::unique_lock <WriteBarrier> lock_write(write_barrier_);
+            size_t element_count = cur_element_count;
+            EntryPoint entry_point = getEntryPoint();
+            // from here on, element_modified_ flags changes since the snapshot
+            checkpoint_location_.clear();
+            std::fill(element_modified_.begin(), element_modified_.end(), 0);
+            // held shared while writing, so that nothing restructures the index
+            lock_write.release();
+            write_barrier_.unlock_and_lock_shared();
+            std::shared_lock <WriteBarrier> lock_shared(write_barrier_, std::adopt_lock);
+            started.set_value();
+
+            // remove the log first: an old log must never be replayed on top of the new file
+            if (remove_log)
+                std::remove(indexLogLocation(location).c_str());
+            std::ofstream output(location, std::ios::binary);
+            if (!output.is_open())
+                throw std::runtime_error("Cannot open file");
+            writeIndexSnapshot(output, element_count, entry_point);
+            size_t file_size = static_cast<size_t>(output.tellp());
+            output.close();
+            if (!output)
+                throw std::runtime_error("Failed to write index");
+            return IndexCheckpoint{location, file_size, element_count};
+        });
+        snapshot_taken.wait();
+        return future;
+    }
+
+
+    // makes the file written by saveIndexAsync the one saveIndexIncremental appends changes to
+    void commitCheckpoint(const IndexCheckpoint &checkpoint) {
+        checkpoint_location_ = checkpoint.location;
+        checkpoint_file_size_ = checkpoint.file_size;
+        checkpoint_file_element_count_ = checkpoint.element_count;
+        checkpoint_element_count_ = checkpoint.element_count;
+    }
+
+
+    void saveIndex(const std::string &location) {
+        std::ofstream output(location, std::ios::binary);
+        writeIndex(output);
         output.close();
+
+        // a full save replaces whatever was logged for this location
+        if (isIndexLog(indexLogLocation(location)))
+            std::remove(indexLogLocation(location).c_str());
+        setCheckpoint(location, indexFileSize(), cur_element_count);
     }
 
 
-    void loadIndex(const std::string &location, SpaceInterface<dist_t> *s, size_t max_elements_i = 0) {
-        std::ifstream input(location, std::ios::binary);
+    static std::string indexLogLocation(const std::string &location) {
+        return location + ".log";
+    }
 
-        if (!input.is_open())
+
+    static bool isIndexLog(const std::string &log_location) {
+        std::ifstream input(log_location, std::ios::binary);
+        unsigned int magic = 0;
+        readBinaryPOD(input, magic);
+        return input && magic == INDEX_LOG_MAGIC;
+    }
+
+
+    void setCheckpoint(const std::string &location, size_t file_size, size_t file_element_count) {
+        checkpoint_location_ = location;
+        checkpoint_file_size_ = file_size;
+        checkpoint_file_element_count_ = file_element_count;
+        checkpoint_element_count_ = cur_element_count;
+        std::fill(element_modified_.begin(), element_modified_.end(), 0);
+    }
+
+
+    /*
+    * Saves the changes since the last save or load of location, by appending the new elements and the
+    * elements modified since then to a log file next to the index file. The log is replayed by loadIndex.
+    * If the index wasn't saved to or loaded from location before, a full save is done instead. Calling
+    * saveIndex compacts the index and the log back into a single file.
+    */
+    void saveIndexIncremental(const std::string &location) {
+        if (location != checkpoint_location_) {
+            saveIndex(location);
+            return;
+        }
+
+        std::vector<tableint> changed;
+        for (size_t i = 0; i < checkpoint_element_count_; i++) {
+            if (element_modified_[i])
+                changed.push_back(i);
+        }
+        for (size_t i = checkpoint_element_count_; i < cur_element_count; i++) {
+            changed.push_back(i);
+        }
+
+        size_t segment_size = 0;
+        for (tableint internal_id : changed) {
+            segment_size += sizeof(internal_id) + size_data_per_element_ + sizeof(unsigned int);
+            segment_size += element_levels_[internal_id] > 0 ? size_links_per_element_ * element_levels_[internal_id] : 0;
+        }
+
+        std::string log_location = indexLogLocation(location);
+        bool new_log = !isIndexLog(log_location);
+        std::ofstream output(log_location, std::ios::binary | (new_log ? std::ios::trunc : std::ios::app));
+        if (!output.is_open())
             throw std::runtime_error("Cannot open file");
+        if (new_log) {
+            unsigned int magic = INDEX_LOG_MAGIC;
+            writeBinaryPOD(output, magic);
+            writeBinaryPOD(output, checkpoint_file_size_);
+            writeBinaryPOD(output, checkpoint_file_element_count_);
+        }
 
-        clear();
-        // get file size:
-        input.seekg(0, input.end);
-        std::streampos total_filesize = input.tellg();
-        input.seekg(0, input.beg);
+        // a segment which is cut short (e.g. by a crash) is ignored when the log is replayed
+        size_t element_count = cur_element_count;
+        writeBinaryPOD(output, segment_size);
+        writeBinaryPOD(output, element_count);
+        EntryPoint entry_point = getEntryPoint();
+        writeBinaryPOD(output, entry_point.level);
+        writeBinaryPOD(output, entry_point.id);
+        for (tableint internal_id : changed) {
+            unsigned int linkListSize = element_levels_[internal_id] > 0 ? size_links_per_element_ * element_levels_[internal_id] : 0;
+            writeBinaryPOD(output, internal_id);
+            writeElement(output, internal_id);
+            writeBinaryPOD(output, linkListSize);
+            if (linkListSize)
+                writeBinaryBytes(output, linkLists_[internal_id], linkListSize);
+        }
+        output.close();
+        if (!output)
+            throw std::runtime_error("Failed to write index log");
+
+        checkpoint_element_count_ = cur_element_count;
+        std::fill(element_modified_.begin(), element_modified_.end(), 0);
+    }
+
+
+    /*
+    * Applies each complete segment of the log written by saveIndexIncremental. Labels and deleted elements
+    * are not updated: that is left to initLoadedIndex.
+    */
+    void replayIndexLog(const std::string &log_location, size_t file_size) {
+        std::ifstream input(log_location, std::ios::binary);
+        unsigned int magic = 0;
+        size_t log_file_size = 0;
+        size_t log_file_element_count = 0;
+        readBinaryPOD(input, magic);
+        readBinaryPOD(input, log_file_size);
+        readBinaryPOD(input, log_file_element_count);
+        if (!input || magic != INDEX_LOG_MAGIC)
+            return;
+        if (log_file_size != file_size || log_file_element_count != cur_element_count)
+            throw std::runtime_error("Index log does not match the index file");
+
+        std::vector<char> segment;
+        while (true) {
+            size_t segment_size = 0;
+            size_t element_count = 0;
+            int maxlevel = 0;
+            tableint enterpoint_node = 0;
+            readBinaryPOD(input, segment_size);
+            readBinaryPOD(input, element_count);
+            readBinaryPOD(input, maxlevel);
+            readBinaryPOD(input, enterpoint_node);
+            if (!input)
+                break;
+            segment.resize(segment_size);
+            input.read(segment.data(), segment_size);
+            if (static_cast<size_t>(input.gcount()) != segment_size)
+                break;
+
+            if (element_count < cur_element_count)
+                throw std::runtime_error("Index log seems to be corrupted");
+            if (element_count > max_elements_)
+                resizeIndex(element_count);
+
+            const char *pos = segment.data();
+            const char *segment_end = pos + segment_size;
+            while (pos < segment_end) {
+                tableint internal_id;
+                unsigned int linkListSize;
+                if (segment_end - pos < (ptrdiff_t) (sizeof(internal_id) + size_data_per_element_ + sizeof(linkListSize)))
+                    throw std::runtime_error("Index log seems to be corrupted");
+                readBinaryPOD(pos, internal_id);
+                if (internal_id >= element_count)
+                    throw std::runtime_error("Index log seems to be corrupted");
+                readElement(internal_id, pos);
+                pos += size_data_per_element_;
+                readBinaryPOD(pos, linkListSize);
+                if ((size_t) (segment_end - pos) < linkListSize)
+                    throw std::runtime_error("Index log seems to be corrupted");
+
+                int level = linkListSize / size_links_per_element_;
+                if (internal_id < cur_element_count) {
+                    // levels never change once an element is added
+                    if (level != element_levels_[internal_id])
+                        throw std::runtime_error("Index log seems to be corrupted");
+                } else {
+                    element_levels_[internal_id] = level;
+                    linkLists_[internal_id] = nullptr;
+                    if (linkListSize)
+                        linkLists_[internal_id] = link_list_arena_.allocate(linkListSize);
+                }
+                if (linkListSize)
+                    memcpy(linkLists_[internal_id], pos, linkListSize);
+                pos += linkListSize;
+            }
+            cur_element_count = element_count;
+            setEntryPoint(enterpoint_node, maxlevel);
+        }
+    }
+
+    /*
+    * Writes the same bytes as saveIndex into buffer, which must be at least indexFileSize() bytes long.
+    */
+    void saveIndexToBuffer(char *buffer) const {
+        writeIndex(buffer);
+    }
 
+
+    template<typename Input>
+    void readIndexHeader(Input &input, SpaceInterface<dist_t> *s, size_t max_elements_i) {
         readBinaryPOD(input, offsetLevel0_);
         readBinaryPOD(input, max_elements_);
         readBinaryPOD(input, cur_element_count);
@@ -735,8 +1959,11 @@ class HierarchicalNSW : public AlgorithmInterface<dist_t> {
         readBinaryPOD(input, size_data_per_element_);
         readBinaryPOD(input, label_offset_);
         readBinaryPOD(input, offsetData_);
-        readBinaryPOD(input, maxlevel_);
-        readBinaryPOD(input, enterpoint_node_);
+        int maxlevel;
+        tableint enterpoint_node;
+        readBinaryPOD(input, maxlevel);
+        readBinaryPOD(input, enterpoint_node);
+        setEntryPoint(enterpoint_node, maxlevel);
 
         readBinaryPOD(input, maxM_);
         readBinaryPOD(input, maxM0_);
@@ -748,91 +1975,280 @@ class HierarchicalNSW : public AlgorithmInterface<dist_t> {
         fstdistfunc_ = s->get_dist_func();
         dist_func_param_ = s->get_dist_func_param();
 
-        auto pos = input.tellg();
+        size_links_per_element_ = maxM_ * sizeof(tableint) + sizeof(linklistsizeint);
+        size_links_level0_ = maxM0_ * sizeof(tableint) + sizeof(linklistsizeint);
+        aligned_layout_ = offsetData_ % LAYOUT_ALIGNMENT == 0 && size_data_per_element_ % LAYOUT_ALIGNMENT == 0;
+    }
 
-        /// Optional - check if index is ok:
-        input.seekg(cur_element_count * size_data_per_element_, input.cur);
-        for (size_t i = 0; i < cur_element_count; i++) {
-            if (input.tellg() < 0 || input.tellg() >= total_filesize) {
-                throw std::runtime_error("Index seems to be corrupted or unsupported");
-            }
 
+    /*
+    * Points each element's upper layer links into block, which holds the block_size bytes after level 0 in
+    * the saved index.
+    */
+    void initLinkListsFromBlock(const char *block, size_t block_size) {
+        linkLists_ = (char **) malloc(sizeof(void *) * max_elements_);
+        if (linkLists_ == nullptr)
+            throw std::runtime_error("Not enough memory: loadIndex failed to allocate linklists");
+        element_levels_ = std::vector<int>(max_elements_);
+        size_t block_pos = 0;
+        for (size_t i = 0; i < cur_element_count; i++) {
             unsigned int linkListSize;
-            readBinaryPOD(input, linkListSize);
-            if (linkListSize != 0) {
-                input.seekg(linkListSize, input.cur);
+            if (block_pos + sizeof(linkListSize) > block_size)
+                throw std::runtime_error("Index seems to be corrupted or unsupported");
+            memcpy(&linkListSize, block + block_pos, sizeof(linkListSize));
+            block_pos += sizeof(linkListSize);
+            if (linkListSize == 0) {
+                element_levels_[i] = 0;
+                linkLists_[i] = nullptr;
+            } else {
+                if (block_pos + linkListSize > block_size)
+                    throw std::runtime_error("Index seems to be corrupted or unsupported");
+                element_levels_[i] = linkListSize / size_links_per_element_;
+                linkLists_[i] = (char *) block + block_pos;
+                block_pos += linkListSize;
             }
         }
-
         // throw exception if it either corrupted or old index
-        if (input.tellg() != total_filesize)
+        if (block_pos != block_size)
             throw std::runtime_error("Index seems to be corrupted or unsupported");
+    }
 
-        input.clear();
-        /// Optional check end
-
-        input.seekg(pos, input.beg);
-
-        data_level0_memory_ = (char *) malloc(max_elements * size_data_per_element_);
-        if (data_level0_memory_ == nullptr)
-            throw std::runtime_error("Not enough memory: loadIndex failed to allocate level0");
-        input.read(data_level0_memory_, cur_element_count * size_data_per_element_);
-
-        size_links_per_element_ = maxM_ * sizeof(tableint) + sizeof(linklistsizeint);
 
-        size_links_level0_ = maxM0_ * sizeof(tableint) + sizeof(linklistsizeint);
-        std::vector<std::mutex>(max_elements).swap(link_list_locks_);
+    /*
+    * Sets up the locks, visited lists, deleted elements and label lookup once the data has been read. If dense
+    * labels were enabled before loading, each label is stored in its own slot of the label array during the same
+    * parallel pass, so no hash table is built. If a label is too large for the array, the index falls back to
+    * label_lookup_.
+    */
+    void initLoadedIndex(size_t num_threads) {
+        std::vector<ElementLock>(max_elements_).swap(link_list_locks_);
+        std::vector<char>(max_elements_).swap(element_modified_);
         std::vector<std::mutex>(MAX_LABEL_OPERATION_LOCKS).swap(label_op_locks_);
 
-        visited_list_pool_.reset(new VisitedListPool(1, max_elements));
+        visited_list_pool_.reset(new VisitedListPool(1, max_elements_));
 
-        linkLists_ = (char **) malloc(sizeof(void *) * max_elements);
-        if (linkLists_ == nullptr)
-            throw std::runtime_error("Not enough memory: loadIndex failed to allocate linklists");
-        element_levels_ = std::vector<int>(max_elements);
         revSize_ = 1.0 / mult_;
         ef_ = 10;
+
+        num_deleted_ = 0;
+        deleted_elements.clear();
+        label_lookup_.clear();
+
+        std::vector<std::atomic<tableint>> lookup(dense_labels_ ? max_elements_ : 0);
+        auto lookup_worker = [&](size_t begin, size_t end) {
+            for (size_t label = begin; label < end; label++)
+                lookup[label].store(NO_INTERNAL_ID, std::memory_order_relaxed);
+        };
+        pforr::parallel_for(0, lookup.size(), lookup_worker, num_threads);
+
+        std::atomic<bool> label_too_large{false};
+        auto element_worker = [&](size_t begin, size_t end) {
+            std::vector<tableint> deleted;
+            for (size_t i = begin; i < end; i++) {
+                if (isMarkedDeleted(i))
+                    deleted.push_back(i);
+                if (dense_labels_) {
+                    labeltype label = getExternalLabel(i);
+                    if (label < max_elements_)
+                        lookup[label].store(i, std::memory_order_relaxed);
+                    else
+                        label_too_large = true;
+                }
+            }
+            num_deleted_ += deleted.size();
+            if (allow_replace_deleted_ && !deleted.empty()) {
+                std::unique_lock <std::mutex> lock_deleted_elements(deleted_elements_lock);
+                deleted_elements.insert(deleted.begin(), deleted.end());
+            }
+        };
+        pforr::parallel_for(0, cur_element_count, element_worker, num_threads);
+
+        if (dense_labels_ && !label_too_large) {
+            dense_label_lookup_.swap(lookup);
+            return;
+        }
+        dense_labels_ = false;
+        std::vector<std::atomic<tableint>>().swap(dense_label_lookup_);
+        label_lookup_.reserve(cur_element_count);
         for (size_t i = 0; i < cur_element_count; i++) {
             label_lookup_[getExternalLabel(i)] = i;
-            unsigned int linkListSize;
-            readBinaryPOD(input, linkListSize);
-            if (linkListSize == 0) {
-                element_levels_[i] = 0;
-                linkLists_[i] = nullptr;
-            } else {
-                element_levels_[i] = linkListSize / size_links_per_element_;
-                linkLists_[i] = (char *) malloc(linkListSize);
-                if (linkLists_[i] == nullptr)
-                    throw std::runtime_error("Not enough memory: loadIndex failed to allocate linklist");
-                input.read(linkLists_[i], linkListSize);
-            }
+        }
+    }
+
+
+    /*
+    * Looks up labels in an array indexed by label rather than in label_lookup_. This uses less memory, and needs
+    * no lock, so parallel addPoint and getDataByLabel calls don't wait on each other. It requires every label,
+    * including those added later, to be less than max_elements_. Returns false, leaving the index unchanged, if
+    * a label of an existing element is too large.
+    */
+    bool useDenseLabels() {
+        std::unique_lock <WriteBarrier> lock_write(write_barrier_);
+        if (dense_labels_) return true;
+        for (const auto &entry : label_lookup_) {
+            if (entry.first >= max_elements_) return false;
         }
 
-        for (size_t i = 0; i < cur_element_count; i++) {
-            if (isMarkedDeleted(i)) {
-                num_deleted_ += 1;
-                if (allow_replace_deleted_) deleted_elements.insert(i);
-            }
+        std::vector<std::atomic<tableint>> lookup(max_elements_);
+        for (size_t label = 0; label < max_elements_; label++) {
+            lookup[label].store(NO_INTERNAL_ID, std::memory_order_relaxed);
         }
+        for (const auto &entry : label_lookup_) {
+            lookup[entry.first].store(entry.second, std::memory_order_relaxed);
+        }
+        dense_label_lookup_.swap(lookup);
+        std::unordered_map<labeltype, tableint>().swap(label_lookup_);
+        dense_labels_ = true;
+        return true;
+    }
+
+
+    // the internal id of the element with the given label, or NO_INTERNAL_ID if there isn't one
+    tableint findInternalId(labeltype label) const {
+        if (dense_labels_) {
+            if (label >= max_elements_) return NO_INTERNAL_ID;
+            return dense_label_lookup_[label].load(std::memory_order_acquire);
+        }
+        std::unique_lock <std::mutex> lock_table(label_lookup_lock);
+        auto search = label_lookup_.find(label);
+        if (search == label_lookup_.end()) return NO_INTERNAL_ID;
+        return search->second;
+    }
+
+
+    /*
+    * Reads nbytes starting at offset of the file into dest. Each thread opens its own stream and reads
+    * one contiguous chunk, so large reads are spread across num_threads.
+    */
+    static void readFileRange(
+        const std::string &location,
+        size_t offset,
+        char *dest,
+        size_t nbytes,
+        size_t num_threads) {
+        const size_t min_chunk_bytes = 1 << 20;
+        auto worker = [&](size_t begin, size_t end) {
+            std::ifstream input(location, std::ios::binary);
+            if (!input.is_open())
+                throw std::runtime_error("Cannot open file");
+            input.seekg(offset + begin, input.beg);
+            input.read(dest + begin, end - begin);
+            if (static_cast<size_t>(input.gcount()) != end - begin)
+                throw std::runtime_error("Index seems to be corrupted or unsupported");
+        };
+        pforr::parallel_for(0, nbytes, worker, num_threads, min_chunk_bytes);
+    }
+
+
+    void loadIndex(const std::string &location, SpaceInterface<dist_t> *s, size_t max_elements_i = 0,
+                   size_t num_threads = 0) {
+        std::ifstream input(location, std::ios::binary);
+
+        if (!input.is_open())
+            throw std::runtime_error("Cannot open file");
 
+        clear();
+        // get file size:
+        input.seekg(0, input.end);
+        size_t total_filesize = input.tellg();
+        input.seekg(0, input.beg);
+
+        readIndexHeader(input, s, max_elements_i);
+
+        if (!input)
+            throw std::runtime_error("Index seems to be corrupted or unsupported");
+        size_t level0_pos = input.tellg();
+        size_t level0_size = cur_element_count * size_data_per_element_;
+        if (level0_pos + level0_size > total_filesize)
+            throw std::runtime_error("Index seems to be corrupted or unsupported");
+        size_t link_lists_pos = level0_pos + level0_size;
+
+        // Everything after level 0 is the upper layers: read it into a single block and point into it
+        // rather than making an allocation per element
+        size_t link_lists_size = total_filesize - link_lists_pos;
+        char *link_lists_block = nullptr;
+        if (link_lists_size > 0) {
+            link_lists_block = link_list_arena_.allocate(link_lists_size);
+            input.seekg(link_lists_pos, input.beg);
+            input.read(link_lists_block, link_lists_size);
+            if (static_cast<size_t>(input.gcount()) != link_lists_size)
+                throw std::runtime_error("Index seems to be corrupted or unsupported");
+        }
         input.close();
 
+        initLinkListsFromBlock(link_lists_block, link_lists_size);
+
+        initLevel0Storage();
+        reserveLevel0(max_elements_);
+        level0_store_.forEachChunk(cur_element_count, [&](char *chunk, size_t first, size_t nelements) {
+            readFileRange(location, level0_pos + first * size_data_per_element_, chunk,
+                          nelements * size_data_per_element_, num_threads);
+        });
+
+        size_t file_element_count = cur_element_count;
+        replayIndexLog(indexLogLocation(location), total_filesize);
+
+        initLoadedIndex(num_threads);
+        setCheckpoint(location, total_filesize, file_element_count);
+
         return;
     }
 
 
+    /*
+    * Loads an index from buffer, which holds buffer_size bytes in the format written by saveIndex.
+    */
+    void loadIndexFromBuffer(const char *buffer, size_t buffer_size, SpaceInterface<dist_t> *s,
+                             size_t max_elements_i = 0, size_t num_threads = 0) {
+        clear();
+
+        if (buffer_size < indexHeaderSize())
+            throw std::runtime_error("Index seems to be corrupted or unsupported");
+        const char *input = buffer;
+        readIndexHeader(input, s, max_elements_i);
+
+        size_t level0_pos = input - buffer;
+        size_t level0_size = cur_element_count * size_data_per_element_;
+        if (level0_pos + level0_size > buffer_size)
+            throw std::runtime_error("Index seems to be corrupted or unsupported");
+        size_t link_lists_pos = level0_pos + level0_size;
+
+        size_t link_lists_size = buffer_size - link_lists_pos;
+        char *link_lists_block = nullptr;
+        if (link_lists_size > 0) {
+            link_lists_block = link_list_arena_.allocate(link_lists_size);
+            memcpy(link_lists_block, buffer + link_lists_pos, link_lists_size);
+        }
+
+        initLinkListsFromBlock(link_lists_block, link_lists_size);
+
+        initLevel0Storage();
+        reserveLevel0(max_elements_);
+        const size_t min_chunk_bytes = 1 << 20;
+        level0_store_.forEachChunk(cur_element_count, [&](char *chunk, size_t first, size_t nelements) {
+            const char *source = buffer + level0_pos + first * size_data_per_element_;
+            auto copy_worker = [&](size_t begin, size_t end) {
+                memcpy(chunk + begin, source + begin, end - begin);
+            };
+            pforr::parallel_for(0, nelements * size_data_per_element_, copy_worker, num_threads, min_chunk_bytes);
+        });
+
+        initLoadedIndex(num_threads);
+        checkpoint_location_.clear();
+    }
+
+
     template<typename data_t>
     std::vector<data_t> getDataByLabel(labeltype label) const {
-        // lock all operations with element by label
-        std::unique_lock <std::mutex> lock_label(getLabelOpMutex(label));
+        // lock all operations with element by label, unless the index is frozen and has no label locks
+        std::unique_lock <std::mutex> lock_label;
+        if (!frozen_)
+            lock_label = std::unique_lock <std::mutex>(getLabelOpMutex(label));
         
-        std::unique_lock <std::mutex> lock_table(label_lookup_lock);
-        auto search = label_lookup_.find(label);
-        if (search == label_lookup_.end() || isMarkedDeleted(search->second)) {
+        tableint internalId = findInternalId(label);
+        if (internalId == NO_INTERNAL_ID || isMarkedDeleted(internalId)) {
             throw std::runtime_error("Label not found");
         }
-        tableint internalId = search->second;
-        lock_table.unlock();
 
         char* data_ptrv = getDataByInternalId(internalId);
         size_t dim = *((size_t *) dist_func_param_);
@@ -846,20 +2262,33 @@ class HierarchicalNSW : public AlgorithmInterface<dist_t> {
     }
 
 
+    /*
+    * Returns a pointer to the stored data of the element with the given label, rather than a copy. Unlike
+    * getDataByLabel, no lock is taken for the label (and with dense labels, none at all), so the element must not
+    * be updated while the pointer is in use.
+    */
+    const char *getDataPtrByLabel(labeltype label) const {
+        tableint internalId = findInternalId(label);
+        if (internalId == NO_INTERNAL_ID || isMarkedDeleted(internalId)) {
+            throw std::runtime_error("Label not found");
+        }
+        return getDataByInternalId(internalId);
+    }
+
+
     /*
     * Marks an element with the given label deleted, does NOT really change the current graph.
     */
     void markDelete(labeltype label) {
+        checkNotFrozen();
+        std::shared_lock <WriteBarrier> lock_write(write_barrier_);
         // lock all operations with element by label
         std::unique_lock <std::mutex> lock_label(getLabelOpMutex(label));
 
-        std::unique_lock <std::mutex> lock_table(label_lookup_lock);
-        auto search = label_lookup_.find(label);
-        if (search == label_lookup_.end()) {
+        tableint internalId = findInternalId(label);
+        if (internalId == NO_INTERNAL_ID) {
             throw std::runtime_error("Label not found");
         }
-        tableint internalId = search->second;
-        lock_table.unlock();
 
         markDeletedInternal(internalId);
     }
@@ -874,6 +2303,7 @@ class HierarchicalNSW : public AlgorithmInterface<dist_t> {
         if (!isMarkedDeleted(internalId)) {
             unsigned char *ll_cur = ((unsigned char *)get_linklist0(internalId))+2;
             *ll_cur |= DELETE_MARK;
+            element_modified_[internalId] = 1;
             num_deleted_ += 1;
             if (allow_replace_deleted_) {
                 std::unique_lock <std::mutex> lock_deleted_elements(deleted_elements_lock);
@@ -892,16 +2322,15 @@ class HierarchicalNSW : public AlgorithmInterface<dist_t> {
     *  because elements marked as deleted can be completely removed by addPoint
     */
     void unmarkDelete(labeltype label) {
+        checkNotFrozen();
+        std::shared_lock <WriteBarrier> lock_write(write_barrier_);
         // lock all operations with element by label
         std::unique_lock <std::mutex> lock_label(getLabelOpMutex(label));
 
-        std::unique_lock <std::mutex> lock_table(label_lookup_lock);
-        auto search = label_lookup_.find(label);
-        if (search == label_lookup_.end()) {
+        tableint internalId = findInternalId(label);
+        if (internalId == NO_INTERNAL_ID) {
             throw std::runtime_error("Label not found");
         }
-        tableint internalId = search->second;
-        lock_table.unlock();
 
         unmarkDeletedInternal(internalId);
     }
@@ -916,6 +2345,7 @@ class HierarchicalNSW : public AlgorithmInterface<dist_t> {
         if (isMarkedDeleted(internalId)) {
             unsigned char *ll_cur = ((unsigned char *)get_linklist0(internalId)) + 2;
             *ll_cur &= ~DELETE_MARK;
+            element_modified_[internalId] = 1;
             num_deleted_ -= 1;
             if (allow_replace_deleted_) {
                 std::unique_lock <std::mutex> lock_deleted_elements(deleted_elements_lock);
@@ -931,6 +2361,8 @@ class HierarchicalNSW : public AlgorithmInterface<dist_t> {
     * Checks the first 16 bits of the memory to see if the element is marked deleted.
     */
     bool isMarkedDeleted(tableint internalId) const {
+        if (links_compressed_)
+            return *getCompressedLinks(internalId) & DELETE_MARK;
         unsigned char *ll_cur = ((unsigned char*)get_linklist0(internalId)) + 2;
         return *ll_cur & DELETE_MARK;
     }
@@ -951,16 +2383,20 @@ class HierarchicalNSW : public AlgorithmInterface<dist_t> {
     * If replacement of deleted elements is enabled: replaces previously deleted point if any, updating it with new point
     */
     void addPoint(const void *data_point, labeltype label, bool replace_deleted = false) {
+        checkNotFrozen();
         if ((allow_replace_deleted_ == false) && (replace_deleted == true)) {
             throw std::runtime_error("Replacement of deleted elements is disabled in constructor");
         }
 
+        std::shared_lock <WriteBarrier> lock_write(write_barrier_);
         // lock all operations with element by label
         std::unique_lock <std::mutex> lock_label(getLabelOpMutex(label));
         if (!replace_deleted) {
             addPoint(data_point, label, -1);
             return;
         }
+        if (dense_labels_ && label >= max_elements_)
+            throw std::runtime_error("Labels must be less than the max element when using dense labels");
         // check if there is vacant place
         tableint internal_id_replaced;
         std::unique_lock <std::mutex> lock_deleted_elements(deleted_elements_lock);
@@ -980,10 +2416,14 @@ class HierarchicalNSW : public AlgorithmInterface<dist_t> {
             labeltype label_replaced = getExternalLabel(internal_id_replaced);
             setExternalLabel(internal_id_replaced, label);
 
-            std::unique_lock <std::mutex> lock_table(label_lookup_lock);
-            label_lookup_.erase(label_replaced);
-            label_lookup_[label] = internal_id_replaced;
-            lock_table.unlock();
+            if (dense_labels_) {
+                dense_label_lookup_[label_replaced].store(NO_INTERNAL_ID, std::memory_order_release);
+                dense_label_lookup_[label].store(internal_id_replaced, std::memory_order_release);
+            } else {
+                std::unique_lock <std::mutex> lock_table(label_lookup_lock);
+                label_lookup_.erase(label_replaced);
+                label_lookup_[label] = internal_id_replaced;
+            }
 
             unmarkDeletedInternal(internal_id_replaced);
             updatePoint(data_point, internal_id_replaced, 1.0);
@@ -992,11 +2432,17 @@ class HierarchicalNSW : public AlgorithmInterface<dist_t> {
 
 
     void updatePoint(const void *dataPoint, tableint internalId, float updateNeighborProbability) {
-        // update the feature vector associated with existing point with new vector
-        memcpy(getDataByInternalId(internalId), dataPoint, data_size_);
+        // update the feature vector associated with existing point with new vector, under the element's lock so
+        // that saveIndexAsync never writes half of it
+        {
+            std::unique_lock <ElementLock> lock(link_list_locks_[internalId]);
+            memcpy(getDataByInternalId(internalId), dataPoint, data_size_);
+        }
+        element_modified_[internalId] = 1;
 
-        int maxLevelCopy = maxlevel_;
-        tableint entryPointCopy = enterpoint_node_;
+        EntryPoint entry_point = getEntryPoint();
+        int maxLevelCopy = entry_point.level;
+        tableint entryPointCopy = entry_point.id;
         // If point to be updated is entry point and graph just contains single element then just return.
         if (entryPointCopy == internalId && cur_element_count == 1)
             return;
@@ -1052,7 +2498,8 @@ class HierarchicalNSW : public AlgorithmInterface<dist_t> {
                 getNeighborsByHeuristic2(candidates, layer == 0 ? maxM0_ : maxM_);
 
                 {
-                    std::unique_lock <std::mutex> lock(link_list_locks_[neigh]);
+                    std::unique_lock <ElementLock> lock(link_list_locks_[neigh]);
+                    element_modified_[neigh] = 1;
                     linklistsizeint *ll_cur;
                     ll_cur = get_linklist_at_level(neigh, layer);
                     size_t candSize = candidates.size();
@@ -1084,7 +2531,7 @@ class HierarchicalNSW : public AlgorithmInterface<dist_t> {
                 while (changed) {
                     changed = false;
                     unsigned int *data;
-                    std::unique_lock <std::mutex> lock(link_list_locks_[currObj]);
+                    std::unique_lock <ElementLock> lock(link_list_locks_[currObj]);
                     data = get_linklist_at_level(currObj, level);
                     int size = getListCount(data);
                     tableint *datal = (tableint *) (data + 1);
@@ -1139,7 +2586,7 @@ class HierarchicalNSW : public AlgorithmInterface<dist_t> {
 
 
     std::vector<tableint> getConnectionsWithLock(tableint internalId, int level) {
-        std::unique_lock <std::mutex> lock(link_list_locks_[internalId]);
+        std::unique_lock <ElementLock> lock(link_list_locks_[internalId]);
         unsigned int *data = get_linklist_at_level(internalId, level);
         int size = getListCount(data);
         std::vector<tableint> result(size);
@@ -1150,20 +2597,31 @@ class HierarchicalNSW : public AlgorithmInterface<dist_t> {
 
 
     tableint addPoint(const void *data_point, labeltype label, int level) {
+        checkNotFrozen();
         tableint cur_c = 0;
         {
             // Checking if the element with the same label already exists
             // if so, updating it *instead* of creating a new element.
-            std::unique_lock <std::mutex> lock_table(label_lookup_lock);
-            auto search = label_lookup_.find(label);
-            if (search != label_lookup_.end()) {
-                tableint existingInternalId = search->second;
+            // with dense labels, there is no table lock: the caller holds the lock for the label
+            std::unique_lock <std::mutex> lock_table(label_lookup_lock, std::defer_lock);
+            tableint existingInternalId;
+            if (dense_labels_) {
+                if (label >= max_elements_)
+                    throw std::runtime_error("Labels must be less than the max element when using dense labels");
+                existingInternalId = dense_label_lookup_[label].load(std::memory_order_acquire);
+            } else {
+                lock_table.lock();
+                auto search = label_lookup_.find(label);
+                existingInternalId = search == label_lookup_.end() ? NO_INTERNAL_ID : search->second;
+            }
+            if (existingInternalId != NO_INTERNAL_ID) {
                 if (allow_replace_deleted_) {
                     if (isMarkedDeleted(existingInternalId)) {
                         throw std::runtime_error("Can't use addPoint to update deleted elements if replacement of deleted elements is enabled.");
                     }
                 }
-                lock_table.unlock();
+                if (lock_table.owns_lock())
+                    lock_table.unlock();
 
                 if (isMarkedDeleted(existingInternalId)) {
                     unmarkDeletedInternal(existingInternalId);
@@ -1173,108 +2631,396 @@ class HierarchicalNSW : public AlgorithmInterface<dist_t> {
                 return existingInternalId;
             }
 
-            if (cur_element_count >= max_elements_) {
-                throw std::runtime_error("The number of elements exceeds the specified limit");
-            }
+            size_t count = cur_element_count.load();
+            do {
+                if (count >= max_elements_) {
+                    throw std::runtime_error("The number of elements exceeds the specified limit");
+                }
+            } while (!cur_element_count.compare_exchange_weak(count, count + 1));
 
-            cur_c = cur_element_count;
-            cur_element_count++;
-            label_lookup_[label] = cur_c;
+            cur_c = count;
+            if (dense_labels_)
+                dense_label_lookup_[label].store(cur_c, std::memory_order_release);
+            else
+                label_lookup_[label] = cur_c;
         }
 
-        std::unique_lock <std::mutex> lock_el(link_list_locks_[cur_c]);
-        int curlevel = getRandomLevel(mult_);
+        int curlevel = getRandomLevel(label, mult_);
         if (level > 0)
             curlevel = level;
-
+        // no lock is needed for cur_c: no other thread can reach it until it is linked in
         element_levels_[cur_c] = curlevel;
 
-        std::unique_lock <std::mutex> templock(global);
-        int maxlevelcopy = maxlevel_;
-        if (curlevel <= maxlevelcopy)
-            templock.unlock();
-        tableint currObj = enterpoint_node_;
-        tableint enterpoint_copy = enterpoint_node_;
-
-        memset(data_level0_memory_ + cur_c * size_data_per_element_ + offsetLevel0_, 0, size_data_per_element_);
+        memset(getElementPtr(cur_c), 0, level0_store_.stride_);
 
         // Initialisation of the data and label
         setExternalLabel(cur_c, label);
         memcpy(getDataByInternalId(cur_c), data_point, data_size_);
 
         if (curlevel) {
-            linkLists_[cur_c] = (char *) malloc(size_links_per_element_ * curlevel + 1);
-            if (linkLists_[cur_c] == nullptr)
-                throw std::runtime_error("Not enough memory: addPoint failed to allocate linklist");
-            memset(linkLists_[cur_c], 0, size_links_per_element_ * curlevel + 1);
-        }
-
-        if ((signed)currObj != -1) {
-            if (curlevel < maxlevelcopy) {
-                dist_t curdist = fstdistfunc_(data_point, getDataByInternalId(currObj), dist_func_param_);
-                for (int level = maxlevelcopy; level > curlevel; level--) {
-                    bool changed = true;
-                    while (changed) {
-                        changed = false;
-                        unsigned int *data;
-                        std::unique_lock <std::mutex> lock(link_list_locks_[currObj]);
-                        data = get_linklist(currObj, level);
-                        int size = getListCount(data);
-
-                        tableint *datal = (tableint *) (data + 1);
-                        for (int i = 0; i < size; i++) {
-                            tableint cand = datal[i];
-                            if (cand < 0 || cand > max_elements_)
-                                throw std::runtime_error("cand error");
-                            dist_t d = fstdistfunc_(data_point, getDataByInternalId(cand), dist_func_param_);
-                            if (d < curdist) {
-                                curdist = d;
-                                currObj = cand;
-                                changed = true;
-                            }
-                        }
+            linkLists_[cur_c] = link_list_arena_.allocate(size_links_per_element_ * curlevel);
+            memset(linkLists_[cur_c], 0, size_links_per_element_ * curlevel);
+        }
+
+        // the first element only has to become the entry point
+        uint64_t packed_entry_point = entry_point_.load(std::memory_order_acquire);
+        if (unpackEntryPoint(packed_entry_point).level < 0 &&
+            entry_point_.compare_exchange_strong(packed_entry_point, packEntryPoint(cur_c, curlevel),
+                                                 std::memory_order_acq_rel)) {
+            return cur_c;
+        }
+        EntryPoint entry_point = unpackEntryPoint(packed_entry_point);
+        int maxlevelcopy = entry_point.level;
+        tableint currObj = entry_point.id;
+        tableint enterpoint_copy = entry_point.id;
+
+        if (curlevel < maxlevelcopy)
+            currObj = searchLevelsGreedy(data_point, currObj, maxlevelcopy, curlevel);
+
+        bool epDeleted = isMarkedDeleted(enterpoint_copy);
+        for (int level = std::min(curlevel, maxlevelcopy); level >= 0; level--) {
+            if (level > maxlevelcopy || level < 0)  // possible?
+                throw std::runtime_error("Level error");
+
+            std::priority_queue<std::pair<dist_t, tableint>, std::vector<std::pair<dist_t, tableint>>, CompareByFirst> top_candidates = searchBaseLayer(
+                    currObj, data_point, level);
+            if (epDeleted) {
+                top_candidates.emplace(fstdistfunc_(data_point, getDataByInternalId(enterpoint_copy), dist_func_param_), enterpoint_copy);
+                if (top_candidates.size() > ef_construction_)
+                    top_candidates.pop();
+            }
+            currObj = mutuallyConnectNewElement(data_point, cur_c, top_candidates, level, false);
+        }
+
+        // only once the element is linked in, so that searches starting from it can leave it
+        if (curlevel > maxlevelcopy)
+            raiseEntryPointLinked(data_point, cur_c, curlevel, maxlevelcopy);
+        return cur_c;
+    }
+
+
+    // greedy search for data_point on each level from top_level down to just above bottom_level, from currObj
+    tableint searchLevelsGreedy(const void *data_point, tableint currObj, int top_level, int bottom_level) {
+        dist_t curdist = fstdistfunc_(data_point, getDataByInternalId(currObj), dist_func_param_);
+        for (int level = top_level; level > bottom_level; level--) {
+            bool changed = true;
+            while (changed) {
+                changed = false;
+                unsigned int *data;
+                std::unique_lock <ElementLock> lock(link_list_locks_[currObj]);
+                data = get_linklist(currObj, level);
+                int size = getListCount(data);
+
+                tableint *datal = (tableint *) (data + 1);
+                for (int i = 0; i < size; i++) {
+                    tableint cand = datal[i];
+                    if (cand < 0 || cand > max_elements_)
+                        throw std::runtime_error("cand error");
+                    dist_t d = fstdistfunc_(data_point, getDataByInternalId(cand), dist_func_param_);
+                    if (d < curdist) {
+                        curdist = d;
+                        currObj = cand;
+                        changed = true;
+                    }
+                }
+            }
+        }
+        return currObj;
+    }
+
+
+    /*
+    * Makes cur_c, which is linked in up to linked_level, the entry point. Elements added at the same time may have
+    * become the entry point above linked_level first, and would otherwise never be linked to cur_c on the levels
+    * they share: so each time the entry point is found to be higher than linked_level, cur_c is linked in up to
+    * the lower of its level and the entry point's, starting from the entry point.
+    */
+    void raiseEntryPointLinked(const void *data_point, tableint cur_c, int curlevel, int linked_level) {
+        uint64_t packed = entry_point_.load(std::memory_order_acquire);
+        while (true) {
+            EntryPoint entry_point = unpackEntryPoint(packed);
+            if (entry_point.level > linked_level) {
+                int top_level = std::min(curlevel, entry_point.level);
+                tableint currObj = searchLevelsGreedy(data_point, entry_point.id, entry_point.level, top_level);
+                bool epDeleted = isMarkedDeleted(entry_point.id);
+                for (int level = top_level; level > linked_level; level--) {
+                    std::priority_queue<std::pair<dist_t, tableint>, std::vector<std::pair<dist_t, tableint>>, CompareByFirst> top_candidates = searchBaseLayer(
+                            currObj, data_point, level);
+                    if (epDeleted) {
+                        top_candidates.emplace(fstdistfunc_(data_point, getDataByInternalId(entry_point.id), dist_func_param_), entry_point.id);
+                        if (top_candidates.size() > ef_construction_)
+                            top_candidates.pop();
                     }
+                    currObj = mutuallyConnectNewElement(data_point, cur_c, top_candidates, level, false);
+                }
+                linked_level = top_level;
+            }
+            if (curlevel <= entry_point.level)
+                return;
+            if (entry_point_.compare_exchange_weak(packed, packEntryPoint(cur_c, curlevel), std::memory_order_acq_rel))
+                return;
+        }
+    }
+
+
+    /*
+    * Adds n new elements so that the resulting graph depends only on the elements, their order and the random
+    * seed, and not on the number of threads. write_point(i, dest) must write the data of the i-th element to dest
+    * and return its label. All the labels are checked to be new before any element is added. The elements are
+    * then added in rounds: each element of a round is searched for in the graph as it was at the start of the
+    * round, and chooses its neighbors from those results and the other elements of the round. Then the links back
+    * to the new elements are made, with neighbor lists which overflow pruned from their old links and the new ones
+    * in order of internal id. Rounds start at 64 elements and grow to a sixteenth of the index, up to
+    * max_round_size, so the first elements are still linked well but later rounds keep every thread busy.
+    */
+    template<typename WritePoint>
+    void addPointsDeterministic(size_t n, WritePoint write_point, size_t num_threads = 0,
+                                size_t max_round_size = 1024) {
+        const size_t min_round_size = 64;
+        const size_t round_fraction = 16;
+        checkNotFrozen();
+        if (max_round_size == 0)
+            throw std::runtime_error("The round size must be positive");
+        std::unique_lock <WriteBarrier> lock_write(write_barrier_);
+        if (cur_element_count + n > max_elements_)
+            throw std::runtime_error("The number of elements exceeds the specified limit");
+
+        const tableint first_id = cur_element_count;
+        std::vector<labeltype> labels(n);
+        auto write_worker = [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; i++) {
+                tableint id = first_id + i;
+                memset(getElementPtr(id), 0, level0_store_.stride_);
+                labels[i] = write_point(i, getDataByInternalId(id));
+                setExternalLabel(id, labels[i]);
+                element_levels_[id] = getRandomLevel(labels[i], mult_);
+            }
+        };
+        pforr::parallel_for(0, n, write_worker, num_threads);
+
+        // nothing refers to the new elements until their labels are checked
+        std::vector<labeltype> sorted_labels(labels);
+        std::sort(sorted_labels.begin(), sorted_labels.end());
+        for (size_t i = 0; i < n; i++) {
+            if (dense_labels_ && sorted_labels[i] >= max_elements_)
+                throw std::runtime_error("Labels must be less than the max element when using dense labels");
+            if ((i > 0 && sorted_labels[i] == sorted_labels[i - 1]) ||
+                findInternalId(sorted_labels[i]) != NO_INTERNAL_ID)
+                throw std::runtime_error("Labels of elements added deterministically must be new");
+        }
+        for (size_t i = 0; i < n; i++) {
+            tableint id = first_id + i;
+            linkLists_[id] = nullptr;
+            if (element_levels_[id]) {
+                linkLists_[id] = link_list_arena_.allocate(size_links_per_element_ * element_levels_[id]);
+                memset(linkLists_[id], 0, size_links_per_element_ * element_levels_[id]);
+            }
+        }
+
+        for (size_t round_start = 0; round_start < n;) {
+            size_t round_size = std::min(std::max(min_round_size, cur_element_count / round_fraction),
+                                         max_round_size);
+            round_size = std::min(round_size, n - round_start);
+            addRoundDeterministic(labels.data() + round_start, round_size, num_threads);
+            round_start += round_size;
+        }
+    }
+
+
+    // a link from source to be added to the list of target at level, made by addRoundDeterministic
+    struct LinkAddition {
+        tableint target;
+        int level;
+        tableint source;
+        dist_t dist;
+    };
+
+
+    // links in the count elements after the last one in the index, whose data and levels are already set
+    void addRoundDeterministic(const labeltype *labels, size_t count, size_t num_threads) {
+        const tableint first_id = cur_element_count;
+        for (size_t i = 0; i < count; i++) {
+            if (dense_labels_) {
+                dense_label_lookup_[labels[i]].store(first_id + i, std::memory_order_release);
+            } else {
+                std::unique_lock <std::mutex> lock_table(label_lookup_lock);
+                label_lookup_[labels[i]] = first_id + i;
+            }
+        }
+        cur_element_count = first_id + count;
+
+        // the neighbors of each new element, farthest first at each level. Searches only follow the links of
+        // elements already in the graph, so each new element's own links can be set as soon as they are chosen
+        EntryPoint entry_point = getEntryPoint();
+        std::vector<std::vector<std::vector<std::pair<dist_t, tableint>>>> neighbors(count);
+        auto search_worker = [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; i++) {
+                tableint id = first_id + i;
+                neighbors[i] = selectNeighborsDeterministic(id, first_id, count, entry_point);
+                for (size_t level = 0; level < neighbors[i].size(); level++) {
+                    linklistsizeint *ll = get_linklist_at_level(id, level);
+                    setListCount(ll, neighbors[i][level].size());
+                    tableint *data = (tableint *) (ll + 1);
+                    for (size_t j = 0; j < neighbors[i][level].size(); j++)
+                        data[j] = neighbors[i][level][j].second;
                 }
+                element_modified_[id] = 1;
+            }
+        };
+        pforr::parallel_for(0, count, search_worker, num_threads);
+
+        // the links back to each new element, grouped by the element and level whose list they are added to
+        std::vector<LinkAddition> additions;
+        for (size_t i = 0; i < count; i++) {
+            for (size_t level = 0; level < neighbors[i].size(); level++) {
+                for (auto &neighbor : neighbors[i][level])
+                    additions.push_back({neighbor.second, (int) level, (tableint) (first_id + i), neighbor.first});
             }
+        }
+        std::sort(additions.begin(), additions.end(), [](const LinkAddition &a, const LinkAddition &b) {
+            return std::tie(a.target, a.level, a.source) < std::tie(b.target, b.level, b.source);
+        });
+        std::vector<size_t> group_starts;
+        for (size_t i = 0; i < additions.size(); i++) {
+            if (i == 0 || additions[i].target != additions[i - 1].target || additions[i].level != additions[i - 1].level)
+                group_starts.push_back(i);
+        }
+        group_starts.push_back(additions.size());
+        auto back_links_worker = [&](size_t begin, size_t end) {
+            for (size_t g = begin; g < end; g++)
+                addLinksDeterministic(additions.data() + group_starts[g], additions.data() + group_starts[g + 1]);
+        };
+        pforr::parallel_for(0, group_starts.size() - 1, back_links_worker, num_threads);
+
+        // the first of the highest elements of the round, and only once the round is linked in
+        tableint top_id = entry_point.id;
+        int top_level = entry_point.level;
+        for (size_t i = 0; i < count; i++) {
+            if (element_levels_[first_id + i] > top_level) {
+                top_id = first_id + i;
+                top_level = element_levels_[top_id];
+            }
+        }
+        if (top_level > entry_point.level)
+            setEntryPoint(top_id, top_level);
+    }
 
-            bool epDeleted = isMarkedDeleted(enterpoint_copy);
-            for (int level = std::min(curlevel, maxlevelcopy); level >= 0; level--) {
-                if (level > maxlevelcopy || level < 0)  // possible?
-                    throw std::runtime_error("Level error");
 
-                std::priority_queue<std::pair<dist_t, tableint>, std::vector<std::pair<dist_t, tableint>>, CompareByFirst> top_candidates = searchBaseLayer(
-                        currObj, data_point, level);
+    // chooses the neighbors of element internal_id at each of its levels, from the graph as it was when the
+    // entry point was read and the count elements from first_id added in the same round
+    std::vector<std::vector<std::pair<dist_t, tableint>>> selectNeighborsDeterministic(
+        tableint internal_id, tableint first_id, size_t count, EntryPoint entry_point) {
+        const void *data_point = getDataByInternalId(internal_id);
+        int curlevel = element_levels_[internal_id];
+        std::vector<std::vector<std::pair<dist_t, tableint>>> selected(curlevel + 1);
+
+        tableint currObj = entry_point.id;
+        if (curlevel < entry_point.level) {
+            dist_t curdist = fstdistfunc_(data_point, getDataByInternalId(currObj), dist_func_param_);
+            for (int level = entry_point.level; level > curlevel; level--) {
+                bool changed = true;
+                while (changed) {
+                    changed = false;
+                    linklistsizeint *data = get_linklist(currObj, level);
+                    int size = getListCount(data);
+                    tableint *datal = (tableint *) (data + 1);
+                    for (int i = 0; i < size; i++) {
+                        tableint cand = datal[i];
+                        dist_t d = fstdistfunc_(data_point, getDataByInternalId(cand), dist_func_param_);
+                        if (d < curdist) {
+                            curdist = d;
+                            currObj = cand;
+                            changed = true;
+                        }
+                    }
+                }
+            }
+        }
+
+        bool epDeleted = entry_point.level >= 0 && isMarkedDeleted(entry_point.id);
+        for (int level = curlevel; level >= 0; level--) {
+            std::priority_queue<std::pair<dist_t, tableint>, std::vector<std::pair<dist_t, tableint>>, CompareByFirst> top_candidates;
+            if (level <= entry_point.level) {
+                top_candidates = searchBaseLayer(currObj, data_point, level);
                 if (epDeleted) {
-                    top_candidates.emplace(fstdistfunc_(data_point, getDataByInternalId(enterpoint_copy), dist_func_param_), enterpoint_copy);
+                    top_candidates.emplace(fstdistfunc_(data_point, getDataByInternalId(entry_point.id), dist_func_param_), entry_point.id);
+                    if (top_candidates.size() > ef_construction_)
+                        top_candidates.pop();
+                }
+            }
+            for (size_t j = 0; j < count; j++) {
+                tableint other = first_id + j;
+                if (other == internal_id || element_levels_[other] < level)
+                    continue;
+                dist_t dist = fstdistfunc_(data_point, getDataByInternalId(other), dist_func_param_);
+                if (top_candidates.size() < ef_construction_ || dist < top_candidates.top().first) {
+                    top_candidates.emplace(dist, other);
                     if (top_candidates.size() > ef_construction_)
                         top_candidates.pop();
                 }
-                currObj = mutuallyConnectNewElement(data_point, cur_c, top_candidates, level, false);
             }
-        } else {
-            // Do nothing for the first element
-            enterpoint_node_ = 0;
-            maxlevel_ = curlevel;
-        }
 
-        // Releasing lock for the maximum level
-        if (curlevel > maxlevelcopy) {
-            enterpoint_node_ = cur_c;
-            maxlevel_ = curlevel;
+            getNeighborsByHeuristic2(top_candidates, M_);
+            while (top_candidates.size() > 0) {
+                selected[level].push_back(top_candidates.top());
+                top_candidates.pop();
+            }
+            // the search at the next level starts from the closest neighbor already in the graph
+            for (auto it = selected[level].rbegin(); it != selected[level].rend(); ++it) {
+                if (it->second < first_id) {
+                    currObj = it->second;
+                    break;
+                }
+            }
         }
-        return cur_c;
+        return selected;
     }
 
 
-    std::priority_queue<std::pair<dist_t, labeltype >>
-    searchKnn(const void *query_data, size_t k, BaseFilterFunctor* isIdAllowed = nullptr) const {
-        std::priority_queue<std::pair<dist_t, labeltype >> result;
-        if (cur_element_count == 0) return result;
+    // adds the links in [begin, end), which all have the same target and level and are in order of source
+    void addLinksDeterministic(const LinkAddition *begin, const LinkAddition *end) {
+        tableint target = begin->target;
+        int level = begin->level;
+        size_t Mcurmax = level ? maxM_ : maxM0_;
+        std::unique_lock <ElementLock> lock(link_list_locks_[target]);
+        linklistsizeint *ll = get_linklist_at_level(target, level);
+        size_t size = getListCount(ll);
+        tableint *data = (tableint *) (ll + 1);
+
+        std::vector<const LinkAddition *> new_links;
+        for (const LinkAddition *addition = begin; addition != end; ++addition) {
+            if (std::find(data, data + size, addition->source) == data + size)
+                new_links.push_back(addition);
+        }
+        if (size + new_links.size() <= Mcurmax) {
+            for (const LinkAddition *addition : new_links)
+                data[size++] = addition->source;
+        } else {
+            const char *target_data = getDataByInternalId(target);
+            std::priority_queue<std::pair<dist_t, tableint>, std::vector<std::pair<dist_t, tableint>>, CompareByFirst> candidates;
+            for (size_t j = 0; j < size; j++)
+                candidates.emplace(fstdistfunc_(getDataByInternalId(data[j]), target_data, dist_func_param_), data[j]);
+            for (const LinkAddition *addition : new_links)
+                candidates.emplace(addition->dist, addition->source);
+            getNeighborsByHeuristic2(candidates, Mcurmax);
+            size = 0;
+            while (candidates.size() > 0) {
+                data[size++] = candidates.top().second;
+                candidates.pop();
+            }
+        }
+        setListCount(ll, size);
+        element_modified_[target] = 1;
+    }
+
 
-        tableint currObj = enterpoint_node_;
-        dist_t curdist = fstdistfunc_(query_data, getDataByInternalId(enterpoint_node_), dist_func_param_);
+    // greedy search from the entry point down to level 1, returning the element to start the base layer search at
+    tableint searchUpperLayers(const void *query_data) const {
+        EntryPoint entry_point = getEntryPoint();
+        tableint currObj = entry_point.id;
+        dist_t curdist = fstdistfunc_(query_data, getDataByInternalId(currObj), dist_func_param_);
 
-        for (int level = maxlevel_; level > 0; level--) {
+        for (int level = entry_point.level; level > 0; level--) {
             bool changed = true;
             while (changed) {
                 changed = false;
@@ -1300,6 +3046,16 @@ class HierarchicalNSW : public AlgorithmInterface<dist_t> {
                 }
             }
         }
+        return currObj;
+    }
+
+
+    std::priority_queue<std::pair<dist_t, labeltype >>
+    searchKnn(const void *query_data, size_t k, BaseFilterFunctor* isIdAllowed = nullptr) const {
+        std::priority_queue<std::pair<dist_t, labeltype >> result;
+        if (cur_element_count == 0) return result;
+
+        tableint currObj = searchUpperLayers(query_data);
 
         std::priority_queue<std::pair<dist_t, tableint>, std::vector<std::pair<dist_t, tableint>>, CompareByFirst> top_candidates;
         bool bare_bone_search = !num_deleted_ && !isIdAllowed;
@@ -1323,6 +3079,41 @@ class HierarchicalNSW : public AlgorithmInterface<dist_t> {
     }
 
 
+    /*
+    * Finds the k nearest neighbors of query_data, writing their labels and distances to labels and distances in
+    * order of increasing distance. Returns the number of neighbors found, which is less than k if not enough
+    * elements could be found. Working memory comes from scratch, so no allocation is done once it has grown to fit.
+    */
+    size_t searchKnn(const void *query_data, size_t k, SearchScratch &scratch, labeltype *labels, dist_t *distances,
+                     BaseFilterFunctor* isIdAllowed = nullptr) const {
+        if (cur_element_count == 0 || k == 0) return 0;
+
+        tableint currObj = searchUpperLayers(query_data);
+
+        bool bare_bone_search = !num_deleted_ && !isIdAllowed;
+        if (bare_bone_search) {
+            searchBaseLayerScratch<true>(currObj, query_data, std::max(ef_, k), scratch, isIdAllowed);
+        } else {
+            searchBaseLayerScratch<false>(currObj, query_data, std::max(ef_, k), scratch, isIdAllowed);
+        }
+
+        std::vector<std::pair<dist_t, tableint>> &top_candidates = scratch.top_candidates;
+        CompareByFirst compare;
+        while (top_candidates.size() > k) {
+            std::pop_heap(top_candidates.begin(), top_candidates.end(), compare);
+            top_candidates.pop_back();
+        }
+        std::sort_heap(top_candidates.begin(), top_candidates.end(), compare);
+
+        size_t nresults = top_candidates.size();
+        for (size_t i = 0; i < nresults; i++) {
+            distances[i] = top_candidates[i].first;
+            labels[i] = getExternalLabel(top_candidates[i].second);
+        }
+        return nresults;
+    }
+
+
     std::vector<std::pair<dist_t, labeltype >>
     searchStopConditionClosest(
         const void *query_data,
@@ -1331,35 +3122,7 @@ class HierarchicalNSW : public AlgorithmInterface<dist_t> {
         std::vector<std::pair<dist_t, labeltype >> result;
         if (cur_element_count == 0) return result;
 
-        tableint currObj = enterpoint_node_;
-        dist_t curdist = fstdistfunc_(query_data, getDataByInternalId(enterpoint_node_), dist_func_param_);
-
-        for (int level = maxlevel_; level > 0; level--) {
-            bool changed = true;
-            while (changed) {
-                changed = false;
-                unsigned int *data;
-
-                data = (unsigned int *) get_linklist(currObj, level);
-                int size = getListCount(data);
-                metric_hops++;
-                metric_distance_computations+=size;
-
-                tableint *datal = (tableint *) (data + 1);
-                for (int i = 0; i < size; i++) {
-                    tableint cand = datal[i];
-                    if (cand < 0 || cand > max_elements_)
-                        throw std::runtime_error("cand error");
-                    dist_t d = fstdistfunc_(query_data, getDataByInternalId(cand), dist_func_param_);
-
-                    if (d < curdist) {
-                        curdist = d;
-                        currObj = cand;
-                        changed = true;
-                    }
-                }
-            }
-        }
+        tableint currObj = searchUpperLayers(query_data);
 
         std::priority_queue<std::pair<dist_t, tableint>, std::vector<std::pair<dist_t, tableint>>, CompareByFirst> top_candidates;
         top_candidates = searchBaseLayerST<false>(currObj, query_data, 0, isIdAllowed, &stop_condition);
@@ -0,0 +1,460 @@
+#pragma once
+
+#include "visited_list_pool.h"
+#include "hnswlib.h"
+#include "pforr/pforr.h"
+#include <algorithm>
+#include <deque>
+#include <fstream>
+#include <memory>
+#include <mutex>
+
+namespace hnswlib {
+
+/*
+* A read-only version of HierarchicalNSW which keeps quantized vectors in memory and reranks from disk. It is
+* opened from a file written by HierarchicalNSW::saveIndex. The graph and the labels are kept in memory, but
+* each vector is only kept as an 8-bit scalar quantized code, which is used to navigate the graph. Distances to
+* the codes are found without decoding them, as a dot product of the codes with weights set up once per query.
+* The full vectors are left in the file and are only read to rerank the final candidates of each search, so a
+* search reads at most max(ef, k) vectors from disk. Only float vectors in an L2 or inner product space are
+* supported. As the graph is kept in full, this uses a quarter of the memory for the vectors but the same for
+* the links: for M = 16 and 128 dimensions, about 2.5 times less memory in all than HierarchicalNSW.
+*/
+template<typename dist_t>
+class HierarchicalNSWDisk {
+ public:
+    static const unsigned char DELETE_MARK = 0x01;
+
+    size_t cur_element_count{0};
+    size_t ef_{10};
+    int maxlevel_{0};
+    tableint enterpoint_node_{0};
+
+    size_t size_links_level0_{0};
+    size_t size_links_per_element_{0};
+    std::vector<char> links_level0_;  // level 0 links (and deleted marks) of each element
+    std::vector<char> link_lists_block_;  // upper layer links of every element
+    std::vector<size_t> link_list_offsets_;  // where each element's upper layer links start in link_lists_block_
+    std::vector<int> element_levels_;
+    std::vector<labeltype> labels_;
+
+    size_t dim_{0};
+    std::vector<unsigned char> codes_;  // dim_ codes per element
+    std::vector<float> code_min_;  // per-dimension quantization offset
+    std::vector<float> code_scale_;  // per-dimension quantization step
+    std::vector<float> code_norms_;  // squared length of each element's decoded vector less code_min_, for L2
+    bool inner_product_{false};
+
+    std::string location_;
+    size_t level0_pos_{0};  // file position of level 0
+    size_t size_data_per_element_{0};  // size of each level 0 record in the file
+    size_t offsetData_{0};  // position of the vector in each level 0 record
+    size_t data_size_{0};
+
+    DISTFUNC<dist_t> fstdistfunc_;
+    void *dist_func_param_{nullptr};
+
+    std::unique_ptr<VisitedListPool> visited_list_pool_{nullptr};
+
+    // open streams on location_ which aren't in use by a search
+    mutable std::mutex streams_lock_;
+    mutable std::deque<std::unique_ptr<std::ifstream>> streams_;
+
+
+    HierarchicalNSWDisk(SpaceInterface<dist_t> *s, const std::string &location, size_t num_threads = 0)
+        : location_(location) {
+        // the changes in the log would be silently missing
+        if (HierarchicalNSW<dist_t>::isIndexLog(HierarchicalNSW<dist_t>::indexLogLocation(location)))
+            throw std::runtime_error("Index has an incremental save log: save it in full before opening it from disk");
+        std::ifstream input(location, std::ios::binary);
+        if (!input.is_open())
+            throw std::runtime_error("Cannot open file");
+        input.seekg(0, input.end);
+        size_t total_filesize = input.tellg();
+        input.seekg(0, input.beg);
+
+        size_t offsetLevel0, max_elements, label_offset, maxM, maxM0, M, ef_construction;
+        double mult;
+        readBinaryPOD(input, offsetLevel0);
+        readBinaryPOD(input, max_elements);
+        readBinaryPOD(input, cur_element_count);
+        readBinaryPOD(input, size_data_per_element_);
+        readBinaryPOD(input, label_offset);
+        readBinaryPOD(input, offsetData_);
+        readBinaryPOD(input, maxlevel_);
+        readBinaryPOD(input, enterpoint_node_);
+        readBinaryPOD(input, maxM);
+        readBinaryPOD(input, maxM0);
+        readBinaryPOD(input, M);
+        readBinaryPOD(input, mult);
+        readBinaryPOD(input, ef_construction);
+        if (!input)
+            throw std::runtime_error("Index seems to be corrupted or unsupported");
+
+        if (dynamic_cast<InnerProductSpace *>(s))
+            inner_product_ = true;
+        else if (!dynamic_cast<L2Space *>(s))
+            throw std::runtime_error("Only L2 and inner product spaces are supported");
+        data_size_ = s->get_data_size();
+        fstdistfunc_ = s->get_dist_func();
+        dist_func_param_ = s->get_dist_func_param();
+        if (label_offset - offsetData_ != data_size_)
+            throw std::runtime_error("Index has a different dimension to the space");
+        dim_ = data_size_ / sizeof(float);
+
+        size_links_level0_ = maxM0 * sizeof(tableint) + sizeof(linklistsizeint);
+        size_links_per_element_ = maxM * sizeof(tableint) + sizeof(linklistsizeint);
+        level0_pos_ = input.tellg();
+        size_t level0_size = cur_element_count * size_data_per_element_;
+        if (level0_pos_ + level0_size > total_filesize)
+            throw std::runtime_error("Index seems to be corrupted or unsupported");
+
+        readUpperLayers(input, total_filesize - level0_pos_ - level0_size);
+        readLevel0(input, label_offset, num_threads);
+
+        visited_list_pool_ = std::unique_ptr<VisitedListPool>(new VisitedListPool(1, cur_element_count));
+    }
+
+
+    void setEf(size_t ef) {
+        ef_ = ef;
+    }
+
+
+    void readUpperLayers(std::ifstream &input, size_t block_size) {
+        link_lists_block_.resize(block_size);
+        input.seekg(level0_pos_ + cur_element_count * size_data_per_element_, input.beg);
+        input.read(link_lists_block_.data(), block_size);
+        if (static_cast<size_t>(input.gcount()) != block_size)
+            throw std::runtime_error("Index seems to be corrupted or unsupported");
+
+        link_list_offsets_.resize(cur_element_count);
+        element_levels_.resize(cur_element_count);
+        size_t block_pos = 0;
+        for (size_t i = 0; i < cur_element_count; i++) {
+            unsigned int linkListSize;
+            if (block_pos + sizeof(linkListSize) > block_size)
+                throw std::runtime_error("Index seems to be corrupted or unsupported");
+            memcpy(&linkListSize, link_lists_block_.data() + block_pos, sizeof(linkListSize));
+            block_pos += sizeof(linkListSize);
+            if (block_pos + linkListSize > block_size)
+                throw std::runtime_error("Index seems to be corrupted or unsupported");
+            element_levels_[i] = linkListSize / size_links_per_element_;
+            link_list_offsets_[i] = block_pos;
+            block_pos += linkListSize;
+        }
+        if (block_pos != block_size)
+            throw std::runtime_error("Index seems to be corrupted or unsupported");
+    }
+
+
+    /*
+    * Streams level 0 from the file twice, a chunk at a time: first to find the range of each dimension, then
+    * to copy the links and labels and quantize the vectors.
+    */
+    void readLevel0(std::ifstream &input, size_t label_offset, size_t num_threads) {
+        const size_t chunk_bytes = 64 << 20;
+        const size_t chunk_elements = std::max(chunk_bytes / size_data_per_element_, (size_t) 1);
+        std::vector<char> chunk;
+
+        auto read_chunk = [&](size_t begin, size_t end) {
+            chunk.resize((end - begin) * size_data_per_element_);
+            input.seekg(level0_pos_ + begin * size_data_per_element_, input.beg);
+            input.read(chunk.data(), chunk.size());
+            if (static_cast<size_t>(input.gcount()) != chunk.size())
+                throw std::runtime_error("Index seems to be corrupted or unsupported");
+        };
+
+        std::vector<float> data_max(dim_, std::numeric_limits<float>::lowest());
+        code_min_.assign(dim_, (std::numeric_limits<float>::max)());
+        for (size_t begin = 0; begin < cur_element_count; begin += chunk_elements) {
+            size_t end = std::min(begin + chunk_elements, cur_element_count);
+            read_chunk(begin, end);
+            for (size_t i = 0; i < end - begin; i++) {
+                const float *data = (const float *) (chunk.data() + i * size_data_per_element_ + offsetData_);
+                for (size_t d = 0; d < dim_; d++) {
+                    code_min_[d] = std::min(code_min_[d], data[d]);
+                    data_max[d] = std::max(data_max[d], data[d]);
+                }
+            }
+        }
+        code_scale_.resize(dim_);
+        for (size_t d = 0; d < dim_; d++) {
+            code_scale_[d] = cur_element_count > 0 ? (data_max[d] - code_min_[d]) / 255.0f : 0.0f;
+        }
+
+        links_level0_.resize(cur_element_count * size_links_level0_);
+        labels_.resize(cur_element_count);
+        codes_.resize(cur_element_count * dim_);
+        if (!inner_product_)
+            code_norms_.resize(cur_element_count);
+        for (size_t begin = 0; begin < cur_element_count; begin += chunk_elements) {
+            size_t end = std::min(begin + chunk_elements, cur_element_count);
+            read_chunk(begin, end);
+            auto worker = [&](size_t chunk_begin, size_t chunk_end) {
+                for (size_t i = chunk_begin; i < chunk_end; i++) {
+                    const char *record = chunk.data() + i * size_data_per_element_;
+                    size_t internal_id = begin + i;
+                    memcpy(links_level0_.data() + internal_id * size_links_level0_, record, size_links_level0_);
+                    memcpy(&labels_[internal_id], record + label_offset, sizeof(labeltype));
+                    unsigned char *code = codes_.data() + internal_id * dim_;
+                    encode((const float *) (record + offsetData_), code);
+                    if (!inner_product_)
+                        code_norms_[internal_id] = codeNorm(code);
+                }
+            };
+            pforr::parallel_for(0, end - begin, worker, num_threads);
+        }
+    }
+
+
+    void encode(const float *data, unsigned char *code) const {
+        for (size_t d = 0; d < dim_; d++) {
+            float scaled = code_scale_[d] > 0 ? (data[d] - code_min_[d]) / code_scale_[d] : 0.0f;
+            code[d] = (unsigned char) std::min(std::max(scaled + 0.5f, 0.0f), 255.0f);
+        }
+    }
+
+
+    /*
+    * Per-thread working memory for the searchKnn overload that writes into caller-provided buffers, as with
+    * HierarchicalNSW::SearchScratch.
+    */
+    struct SearchScratch {
+        std::vector<std::pair<dist_t, tableint>> top_candidates;
+        std::vector<std::pair<dist_t, tableint>> candidate_set;
+        std::vector<float> weights;
+        float offset{0};
+        std::vector<char> data;
+    };
+
+
+    // squared length of the decoded vector less code_min_
+    float codeNorm(const unsigned char *code) const {
+        float norm = 0;
+        for (size_t d = 0; d < dim_; d++) {
+            float value = code[d] * code_scale_[d];
+            norm += value * value;
+        }
+        return norm;
+    }
+
+
+    /*
+    * Sets up the weights and offset in scratch which codeDistance uses to find the distance from query_data. An
+    * element's decoded vector is code_min_ + code_scale_ * code, so with q' = query - code_min_, the L2 distance
+    * is |q'|^2 + code_norms_ - 2 sum(q' * code_scale_ * code), and the inner product distance is
+    * 1 - sum(query * code_min_) - sum(query * code_scale_ * code).
+    */
+    void prepareQuery(const void *query_data, SearchScratch &scratch) const {
+        const float *query = (const float *) query_data;
+        scratch.weights.resize(dim_);
+        float offset = 0;
+        for (size_t d = 0; d < dim_; d++) {
+            if (inner_product_) {
+                scratch.weights[d] = -query[d] * code_scale_[d];
+                offset += query[d] * code_min_[d];
+            } else {
+                float shifted = query[d] - code_min_[d];
+                scratch.weights[d] = -2 * shifted * code_scale_[d];
+                offset += shifted * shifted;
+            }
+        }
+        scratch.offset = inner_product_ ? 1 - offset : offset;
+    }
+
+
+    // distance from the query set up by prepareQuery to the quantized vector of internal_id
+    inline dist_t codeDistance(tableint internal_id, const SearchScratch &scratch) const {
+        const unsigned char *code = codes_.data() + internal_id * dim_;
+        const float *weights = scratch.weights.data();
+        float sum = 0;
+        for (size_t d = 0; d < dim_; d++) {
+            sum += weights[d] * code[d];
+        }
+        return scratch.offset + sum + (inner_product_ ? 0 : code_norms_[internal_id]);
+    }
+
+
+    inline linklistsizeint *get_linklist0(tableint internal_id) const {
+        return (linklistsizeint *) (links_level0_.data() + internal_id * size_links_level0_);
+    }
+
+
+    inline linklistsizeint *get_linklist(tableint internal_id, int level) const {
+        return (linklistsizeint *) (link_lists_block_.data() + link_list_offsets_[internal_id] +
+            (level - 1) * size_links_per_element_);
+    }
+
+
+    unsigned short int getListCount(linklistsizeint * ptr) const {
+        return *((unsigned short int *)ptr);
+    }
+
+
+    bool isMarkedDeleted(tableint internal_id) const {
+        unsigned char *ll_cur = ((unsigned char*)get_linklist0(internal_id)) + 2;
+        return *ll_cur & DELETE_MARK;
+    }
+
+
+    std::unique_ptr<std::ifstream> getFreeStream() const {
+        {
+            std::unique_lock <std::mutex> lock(streams_lock_);
+            if (!streams_.empty()) {
+                std::unique_ptr<std::ifstream> stream = std::move(streams_.back());
+                streams_.pop_back();
+                return stream;
+            }
+        }
+        std::unique_ptr<std::ifstream> stream(new std::ifstream(location_, std::ios::binary));
+        if (!stream->is_open())
+            throw std::runtime_error("Cannot open file");
+        return stream;
+    }
+
+
+    void releaseStream(std::unique_ptr<std::ifstream> stream) const {
+        std::unique_lock <std::mutex> lock(streams_lock_);
+        streams_.push_back(std::move(stream));
+    }
+
+
+
+    // leaves the ef closest candidates to the query set up in scratch as a max-heap in scratch.top_candidates
+    void searchBaseLayer(tableint ep_id, size_t ef, SearchScratch &scratch) const {
+        VisitedList *vl = visited_list_pool_->getFreeVisitedList();
+        vl_type *visited_array = vl->mass;
+        vl_type visited_array_tag = vl->curV;
+
+        std::vector<std::pair<dist_t, tableint>> &top_candidates = scratch.top_candidates;
+        std::vector<std::pair<dist_t, tableint>> &candidate_set = scratch.candidate_set;
+        top_candidates.clear();
+        candidate_set.clear();
+        typename HierarchicalNSW<dist_t>::CompareByFirst compare;
+
+        dist_t dist = codeDistance(ep_id, scratch);
+        dist_t lowerBound = std::numeric_limits<dist_t>::max();
+        if (!isMarkedDeleted(ep_id)) {
+            top_candidates.emplace_back(dist, ep_id);
+            lowerBound = dist;
+        }
+        candidate_set.emplace_back(-dist, ep_id);
+        visited_array[ep_id] = visited_array_tag;
+
+        while (!candidate_set.empty()) {
+            std::pair<dist_t, tableint> current_node_pair = candidate_set.front();
+            if ((-current_node_pair.first) > lowerBound && top_candidates.size() == ef) {
+                break;
+            }
+            std::pop_heap(candidate_set.begin(), candidate_set.end(), compare);
+            candidate_set.pop_back();
+
+            linklistsizeint *data = get_linklist0(current_node_pair.second);
+            size_t size = getListCount(data);
+            tableint *datal = (tableint *) (data + 1);
+            for (size_t j = 0; j < size; j++) {
+                tableint candidate_id = datal[j];
+                if (visited_array[candidate_id] == visited_array_tag) continue;
+                visited_array[candidate_id] = visited_array_tag;
+
+                dist_t dist1 = codeDistance(candidate_id, scratch);
+                if (top_candidates.size() < ef || lowerBound > dist1) {
+                    candidate_set.emplace_back(-dist1, candidate_id);
+                    std::push_heap(candidate_set.begin(), candidate_set.end(), compare);
+                    if (!isMarkedDeleted(candidate_id)) {
+                        top_candidates.emplace_back(dist1, candidate_id);
+                        std::push_heap(top_candidates.begin(), top_candidates.end(), compare);
+                    }
+                    if (top_candidates.size() > ef) {
+                        std::pop_heap(top_candidates.begin(), top_candidates.end(), compare);
+                        top_candidates.pop_back();
+                    }
+                    if (!top_candidates.empty())
+                        lowerBound = top_candidates.front().first;
+                }
+            }
+        }
+        visited_list_pool_->releaseVisitedList(vl);
+    }
+
+
+    std::priority_queue<std::pair<dist_t, labeltype >>
+    searchKnn(const void *query_data, size_t k) const {
+        std::priority_queue<std::pair<dist_t, labeltype >> result;
+        SearchScratch scratch;
+        std::vector<labeltype> labels(k);
+        std::vector<dist_t> distances(k);
+        size_t nresults = searchKnn(query_data, k, scratch, labels.data(), distances.data());
+        for (size_t i = 0; i < nresults; i++) {
+            result.emplace(distances[i], labels[i]);
+        }
+        return result;
+    }
+
+
+    /*
+    * Finds the k nearest neighbors of query_data, writing their labels and distances to labels and distances in
+    * order of increasing distance, and returns how many were found. Apart from the visited list, which comes from
+    * the pool, working memory comes from scratch.
+    */
+    size_t searchKnn(const void *query_data, size_t k, SearchScratch &scratch, labeltype *labels,
+                     dist_t *distances) const {
+        if (cur_element_count == 0 || k == 0) return 0;
+
+        prepareQuery(query_data, scratch);
+        tableint currObj = enterpoint_node_;
+        dist_t curdist = codeDistance(currObj, scratch);
+        for (int level = maxlevel_; level > 0; level--) {
+            bool changed = true;
+            while (changed) {
+                changed = false;
+                linklistsizeint *data = get_linklist(currObj, level);
+                int size = getListCount(data);
+                tableint *datal = (tableint *) (data + 1);
+                for (int i = 0; i < size; i++) {
+                    tableint cand = datal[i];
+                    if (cand >= cur_element_count)
+                        throw std::runtime_error("cand error");
+                    dist_t d = codeDistance(cand, scratch);
+                    if (d < curdist) {
+                        curdist = d;
+                        currObj = cand;
+                        changed = true;
+                    }
+                }
+            }
+        }
+
+        searchBaseLayer(currObj, std::max(ef_, k), scratch);
+
+        // rerank with the full vectors, reading them in file order
+        std::vector<std::pair<dist_t, tableint>> &candidates = scratch.top_candidates;
+        std::sort(candidates.begin(), candidates.end(),
+                  [](const std::pair<dist_t, tableint> &a, const std::pair<dist_t, tableint> &b) {
+                      return a.second < b.second;
+                  });
+
+        scratch.data.resize(data_size_);
+        std::unique_ptr<std::ifstream> stream = getFreeStream();
+        for (std::pair<dist_t, tableint> &candidate : candidates) {
+            stream->seekg(level0_pos_ + candidate.second * size_data_per_element_ + offsetData_, stream->beg);
+            stream->read(scratch.data.data(), data_size_);
+            if (static_cast<size_t>(stream->gcount()) != data_size_)
+                throw std::runtime_error("Failed to read vector from index file");
+            candidate.first = fstdistfunc_(query_data, scratch.data.data(), dist_func_param_);
+        }
+        releaseStream(std::move(stream));
+
+        size_t nresults = std::min(k, candidates.size());
+        std::partial_sort(candidates.begin(), candidates.begin() + nresults, candidates.end(),
+                          typename HierarchicalNSW<dist_t>::CompareByFirst());
+        for (size_t i = 0; i < nresults; i++) {
+            distances[i] = candidates[i].first;
+            labels[i] = labels_[candidates[i].second];
+        }
+        return nresults;
+    }
+};
+}  // namespace hnswlib
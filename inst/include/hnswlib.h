@@ -167,6 +167,28 @@ static void readBinaryPOD(std::istream &in, T &podRef) {
     in.read((char *) &podRef, sizeof(T));
 }
 
+// Buffer equivalents of the stream functions above: the pointer is advanced past what was written or read
+template<typename T>
+static void writeBinaryPOD(char *&out, const T &podRef) {
+    memcpy(out, (const char *) &podRef, sizeof(T));
+    out += sizeof(T);
+}
+
+template<typename T>
+static void readBinaryPOD(const char *&in, T &podRef) {
+    memcpy((char *) &podRef, in, sizeof(T));
+    in += sizeof(T);
+}
+
+static inline void writeBinaryBytes(std::ostream &out, const char *src, size_t size) {
+    out.write(src, size);
+}
+
+static inline void writeBinaryBytes(char *&out, const char *src, size_t size) {
+    memcpy(out, src, size);
+    out += size;
+}
+
 template<typename MTYPE>
 using DISTFUNC = MTYPE(*)(const void *, const void *, const void *);
 
@@ -223,6 +245,8 @@ AlgorithmInterface<dist_t>::searchKnnCloserFirst(const void* query_data, size_t
 
 #include "space_l2.h"
 #include "space_ip.h"
+#include "space_sparse.h"
 #include "stop_condition.h"
 #include "bruteforce.h"
 #include "hnswalg.h"
+#include "hnswdisk.h"
@@ -0,0 +1,147 @@
+#pragma once
+#include "hnswlib.h"
+#include <memory>
+#include <mutex>
+
+namespace hnswlib {
+
+/*
+* A sparse vector, with its non-zero values in order of increasing index. The sparse spaces store only this
+* handle in the index: the indices and values of stored vectors are owned by the space's SparseVectorArena.
+*/
+struct SparseVector {
+    const unsigned int *indices;
+    const float *values;
+    size_t nnz;
+};
+
+/*
+* Append-only storage for the indices and values of sparse vectors. Storage is allocated in large blocks which
+* never move, so handles to vectors stay valid as more are added. Memory is only released when the arena is.
+*/
+class SparseVectorArena {
+    static const size_t BLOCK_SIZE = 1 << 20;
+
+    std::mutex lock_;
+    std::vector<std::unique_ptr<char[]>> blocks_;
+    size_t block_used_{BLOCK_SIZE};
+    size_t block_capacity_{BLOCK_SIZE};
+
+ public:
+    SparseVector add(const unsigned int *indices, const float *values, size_t nnz) {
+        size_t nbytes = nnz * (sizeof(unsigned int) + sizeof(float));
+        char *dest;
+        {
+            std::unique_lock <std::mutex> lock(lock_);
+            if (block_used_ + nbytes > block_capacity_) {
+                block_capacity_ = std::max(nbytes, (size_t) BLOCK_SIZE);
+                blocks_.emplace_back(new char[block_capacity_]);
+                block_used_ = 0;
+            }
+            dest = blocks_.back().get() + block_used_;
+            block_used_ += nbytes;
+        }
+        unsigned int *dest_indices = (unsigned int *) dest;
+        float *dest_values = (float *) (dest + nnz * sizeof(unsigned int));
+        memcpy(dest_indices, indices, nnz * sizeof(unsigned int));
+        memcpy(dest_values, values, nnz * sizeof(float));
+        return SparseVector{dest_indices, dest_values, nnz};
+    }
+};
+
+static float
+SparseInnerProduct(const void *pVect1, const void *pVect2, const void *) {
+    const SparseVector *v1 = (const SparseVector *) pVect1;
+    const SparseVector *v2 = (const SparseVector *) pVect2;
+    float res = 0;
+    size_t i = 0, j = 0;
+    while (i < v1->nnz && j < v2->nnz) {
+        if (v1->indices[i] == v2->indices[j]) {
+            res += v1->values[i] * v2->values[j];
+            i++;
+            j++;
+        } else if (v1->indices[i] < v2->indices[j]) {
+            i++;
+        } else {
+            j++;
+        }
+    }
+    return res;
+}
+
+static float
+SparseInnerProductDistance(const void *pVect1, const void *pVect2, const void *qty_ptr) {
+    return 1.0f - SparseInnerProduct(pVect1, pVect2, qty_ptr);
+}
+
+static float
+SparseL2Sqr(const void *pVect1, const void *pVect2, const void *) {
+    const SparseVector *v1 = (const SparseVector *) pVect1;
+    const SparseVector *v2 = (const SparseVector *) pVect2;
+    float res = 0;
+    size_t i = 0, j = 0;
+    while (i < v1->nnz && j < v2->nnz) {
+        float t;
+        if (v1->indices[i] == v2->indices[j]) {
+            t = v1->values[i] - v2->values[j];
+            i++;
+            j++;
+        } else if (v1->indices[i] < v2->indices[j]) {
+            t = v1->values[i];
+            i++;
+        } else {
+            t = v2->values[j];
+            j++;
+        }
+        res += t * t;
+    }
+    for (; i < v1->nnz; i++) {
+        res += v1->values[i] * v1->values[i];
+    }
+    for (; j < v2->nnz; j++) {
+        res += v2->values[j] * v2->values[j];
+    }
+    return res;
+}
+
+/*
+* Base class of the sparse spaces. Points passed to the index must be SparseVectors, and those added to the
+* index should have their indices and values stored in arena().
+*/
+class SparseSpace : public SpaceInterface<float> {
+    DISTFUNC<float> fstdistfunc_;
+    size_t dim_;
+    SparseVectorArena arena_;
+
+ public:
+    SparseSpace(size_t dim, DISTFUNC<float> fstdistfunc) : fstdistfunc_(fstdistfunc), dim_(dim) {}
+
+    size_t get_data_size() {
+        return sizeof(SparseVector);
+    }
+
+    DISTFUNC<float> get_dist_func() {
+        return fstdistfunc_;
+    }
+
+    void *get_dist_func_param() {
+        return &dim_;
+    }
+
+    SparseVectorArena &arena() {
+        return arena_;
+    }
+
+    ~SparseSpace() {}
+};
+
+class SparseL2Space : public SparseSpace {
+ public:
+    SparseL2Space(size_t dim) : SparseSpace(dim, SparseL2Sqr) {}
+};
+
+class SparseInnerProductSpace : public SparseSpace {
+ public:
+    SparseInnerProductSpace(size_t dim) : SparseSpace(dim, SparseInnerProductDistance) {}
+};
+}  // namespace hnswlib
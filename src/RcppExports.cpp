@@ -15,12 +15,16 @@ RcppExport SEXP _rcpp_module_boot_HnswL2();
 RcppExport SEXP _rcpp_module_boot_HnswCosine();
 RcppExport SEXP _rcpp_module_boot_HnswIp();
 RcppExport SEXP _rcpp_module_boot_HnswEuclidean();
+RcppExport SEXP _rcpp_module_boot_HnswDisk();
+RcppExport SEXP _rcpp_module_boot_HnswSparse();
 
 static const R_CallMethodDef CallEntries[] = {
     {"_rcpp_module_boot_HnswL2", (DL_FUNC) &_rcpp_module_boot_HnswL2, 0},
     {"_rcpp_module_boot_HnswCosine", (DL_FUNC) &_rcpp_module_boot_HnswCosine, 0},
     {"_rcpp_module_boot_HnswIp", (DL_FUNC) &_rcpp_module_boot_HnswIp, 0},
     {"_rcpp_module_boot_HnswEuclidean", (DL_FUNC) &_rcpp_module_boot_HnswEuclidean, 0},
+    {"_rcpp_module_boot_HnswDisk", (DL_FUNC) &_rcpp_module_boot_HnswDisk, 0},
+    {"_rcpp_module_boot_HnswSparse", (DL_FUNC) &_rcpp_module_boot_HnswSparse, 0},
     {NULL, NULL, 0}
 };
 
@@ -19,6 +19,8 @@
 // along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
 #include <algorithm>
+#include <chrono>
+#include <future>
 #include <iostream>
 #include <limits>
 #include <memory>
@@ -27,10 +29,13 @@
 #include <Rcpp.h>
 
 #include "rcpphnsw.h"
+#include "vecfile.h"
 
 #include "pforr/pforr.h"
 
 template <typename dist_t, bool DoNormalize = false> struct Normalizer {
+  static void normalize(dist_t *vec, std::size_t dim) {}
+
   static void normalize(std::vector<dist_t> &vec) {}
 };
 
@@ -38,7 +43,10 @@ template <typename dist_t> struct Normalizer<dist_t, true> {
   static const constexpr float FLOAT_MIN = 1e-30F;
 
   static void normalize(std::vector<dist_t> &vec) {
-    const std::size_t dim = vec.size();
+    normalize(vec.data(), vec.size());
+  }
+
+  static void normalize(dist_t *vec, std::size_t dim) {
     float norm = 0.0F;
     for (std::size_t i = 0; i < dim; i++) {
       norm += vec[i] * vec[i];
@@ -54,6 +62,10 @@ template <typename dist_t> struct Normalizer<dist_t, true> {
 struct NoDistanceProcess {
   template <typename dist_t>
   static void process_distances(std::vector<dist_t> &vec) {}
+
+  template <typename dist_t> static auto process_distance(dist_t d) -> dist_t {
+    return d;
+  }
 };
 
 struct SquareRootDistanceProcess {
@@ -63,10 +75,42 @@ struct SquareRootDistanceProcess {
       vec[i] = std::sqrt(vec[i]);
     }
   }
+
+  template <typename dist_t> static auto process_distance(dist_t d) -> dist_t {
+    return std::sqrt(d);
+  }
 };
 
+// returns the float32 values passed from R as either a raw vector of their
+// bytes, or an integer vector of their bits (the format used by the float
+// package), checking that there are nvalues of them
+inline auto float32_data(SEXP items, std::size_t nvalues) -> const float * {
+  std::size_t nbytes = 0;
+  const void *data = nullptr;
+  switch (TYPEOF(items)) {
+  case RAWSXP:
+    nbytes = Rf_xlength(items);
+    data = RAW(items);
+    break;
+  case INTSXP:
+    nbytes = Rf_xlength(items) * sizeof(int);
+    data = INTEGER(items);
+    break;
+  default:
+    Rcpp::stop("float32 items must be stored in a raw or integer vector");
+  }
+  if (nbytes != nvalues * sizeof(float)) {
+    Rcpp::stop("float32 items have incorrect size");
+  }
+  return static_cast<const float *>(data);
+}
+
+// Index - hnswlib::HierarchicalNSW, or hnswlib::HierarchicalNSWDisk for a
+//  read-only index searched from disk. Only the search methods can be used
+//  with the latter.
 template <typename dist_t, typename Distance, bool DoNormalize,
-          typename DistanceProcess>
+          typename DistanceProcess,
+          typename Index = hnswlib::HierarchicalNSW<dist_t>>
 class Hnsw {
   static const constexpr std::size_t M_DEFAULT = 16;
   static const constexpr std::size_t EF_CONSTRUCTION_DEFAULT = 200;
@@ -85,33 +129,45 @@ public:
        std::size_t ef_construction = EF_CONSTRUCTION_DEFAULT)
       : dim(dim), normalize(false), cur_l(0), numThreads(0), grainSize(1),
         space(std::unique_ptr<Distance>(new Distance(dim))),
-        appr_alg(std::unique_ptr<hnswlib::HierarchicalNSW<dist_t>>(
-            new hnswlib::HierarchicalNSW<dist_t>(space.get(), max_elements, M,
-                                                 ef_construction))) {}
+        appr_alg(std::unique_ptr<Index>(
+            new Index(space.get(), max_elements, M, ef_construction))) {
+    useDenseLabels();
+  }
 
   Hnsw(int dim, std::size_t max_elements, std::size_t M,
        std::size_t ef_construction, std::size_t random_seed)
       : dim(dim), normalize(false), cur_l(0), numThreads(0), grainSize(1),
         space(std::unique_ptr<Distance>(new Distance(dim))),
-        appr_alg(std::unique_ptr<hnswlib::HierarchicalNSW<dist_t>>(
-            new hnswlib::HierarchicalNSW<dist_t>(
-                space.get(), max_elements, M, ef_construction, random_seed))) {}
+        appr_alg(std::unique_ptr<Index>(new Index(
+            space.get(), max_elements, M, ef_construction, random_seed))) {
+    useDenseLabels();
+  }
 
   Hnsw(int dim, const std::string &path_to_index)
       : dim(dim), normalize(false), cur_l(0), numThreads(0), grainSize(1),
         space(std::unique_ptr<Distance>(new Distance(dim))),
-        appr_alg(std::unique_ptr<hnswlib::HierarchicalNSW<dist_t>>(
-            new hnswlib::HierarchicalNSW<dist_t>(space.get(), path_to_index))) {
+        appr_alg(readIndex(path_to_index, 0, 0)) {
     cur_l = appr_alg->cur_element_count;
+    useDenseLabels();
   }
 
   Hnsw(int dim, const std::string &path_to_index, std::size_t max_elements)
       : dim(dim), normalize(false), cur_l(0), numThreads(0), grainSize(1),
         space(std::unique_ptr<Distance>(new Distance(dim))),
-        appr_alg(std::unique_ptr<hnswlib::HierarchicalNSW<dist_t>>(
-            new hnswlib::HierarchicalNSW<dist_t>(space.get(), path_to_index,
-                                                 false, max_elements))) {
+        appr_alg(readIndex(path_to_index, max_elements, 0)) {
+    cur_l = appr_alg->cur_element_count;
+    useDenseLabels();
+  }
+
+  // n_threads - number of threads used to read the index. Also used for any
+  //  subsequent operations, as if setNumThreads had been called.
+  Hnsw(int dim, const std::string &path_to_index, std::size_t max_elements,
+       std::size_t n_threads)
+      : dim(dim), normalize(false), cur_l(0), numThreads(n_threads),
+        grainSize(1), space(std::unique_ptr<Distance>(new Distance(dim))),
+        appr_alg(readIndex(path_to_index, max_elements, n_threads)) {
     cur_l = appr_alg->cur_element_count;
+    useDenseLabels();
   }
 
   void setEf(std::size_t ef) { appr_alg->ef_ = ef; }
@@ -143,14 +199,50 @@ public:
       Rcpp::stop("Index is too small to contain all items");
     }
 
-    auto data = Rcpp::as<std::vector<dist_t>>(items);
+    addItemsColImpl(items.begin(), nitems, ndim);
+  }
+
+  // items: float32 values of an ndim * nitems matrix (see float32_data)
+  void addItemsColFloat(SEXP items, std::size_t nitems) {
+    const std::size_t ndim = dim;
+    if (cur_l + nitems > appr_alg->max_elements_) {
+      Rcpp::stop("Index is too small to contain all items");
+    }
+
+    addItemsColImpl(float32_data(items, ndim * nitems), nitems, ndim);
+  }
+
+  // data: ndim * nitems, i.e. each item is stored contiguously. Each item is
+  // converted to dist_t in the workers, rather than copying the whole matrix
+  // up front
+  template <typename T>
+  void addItemsColImpl(const T *data, std::size_t nitems, std::size_t ndim) {
+    const std::size_t index_start = cur_l;
+
+    if (deterministic) {
+      auto write_item = [&](std::size_t i, void *dest) -> hnswlib::labeltype {
+        const T *first = data + ndim * i;
+        dist_t *item = static_cast<dist_t *>(dest);
+        std::copy(first, first + ndim, item);
+        Normalizer<dist_t, DoNormalize>::normalize(item, ndim);
+        return index_start + i;
+      };
+      appr_alg->addPointsDeterministic(nitems, write_item, numThreads);
+      cur_l = size();
+      return;
+    }
 
-    auto data_begin = data.cbegin();
     auto worker = [&](std::size_t begin, std::size_t end) {
+      std::vector<dist_t> item_copy(ndim);
       for (auto i = begin; i < end; i++) {
-        auto first = data_begin + ndim * i;
-        std::vector<dist_t> item_copy(first, first + ndim);
-        addItemImpl(item_copy, index_start + i);
+        const T *first = data + ndim * i;
+        if (!DoNormalize && std::is_same<T, dist_t>::value) {
+          // nothing to convert, so addPoint can copy from data directly
+          appr_alg->addPoint(first, index_start + i);
+        } else {
+          std::copy(first, first + ndim, item_copy.begin());
+          addItemImpl(item_copy, index_start + i);
+        }
       }
     };
     pforr::parallel_for(0, nitems, worker, numThreads, grainSize);
@@ -170,7 +262,38 @@ public:
       Rcpp::stop("Index is too small to contain all items");
     }
 
-    auto data = Rcpp::as<std::vector<dist_t>>(items);
+    addItemsImpl(items.begin(), nitems, ndim);
+  }
+
+  // items: float32 values of an nitems * ndim matrix (see float32_data)
+  void addItemsFloat(SEXP items, std::size_t nitems) {
+    const std::size_t ndim = dim;
+    if (cur_l + nitems > appr_alg->max_elements_) {
+      Rcpp::stop("Index is too small to contain all items");
+    }
+
+    addItemsImpl(float32_data(items, nitems * ndim), nitems, ndim);
+  }
+
+  // data: nitems * ndim, stored column-wise as in R
+  template <typename T>
+  void addItemsImpl(const T *data, std::size_t nitems, std::size_t ndim) {
+    const std::size_t index_start = cur_l;
+
+    if (deterministic) {
+      auto write_item = [&](std::size_t i, void *dest) -> hnswlib::labeltype {
+        dist_t *item = static_cast<dist_t *>(dest);
+        for (std::size_t j = 0; j < ndim; j++) {
+          item[j] = data[nitems * j + i];
+        }
+        Normalizer<dist_t, DoNormalize>::normalize(item, ndim);
+        return index_start + i;
+      };
+      appr_alg->addPointsDeterministic(nitems, write_item, numThreads);
+      cur_l = size();
+      return;
+    }
+
     auto worker = [&](std::size_t begin, std::size_t end) {
       std::vector<dist_t> item_copy(ndim);
       for (auto i = begin; i < end; i++) {
@@ -185,6 +308,119 @@ public:
     cur_l = size();
   }
 
+  // adds the items stored in filename (see VecFileReader for the formats),
+  // reading chunk_size items at a time. The next chunk is read while the
+  // current one is being added, so the whole file is never in memory
+  void addItemsFile(const std::string &filename, const std::string &format,
+                    std::size_t chunk_size) {
+    VecFileReader reader(filename, format, dim);
+    const std::size_t ndim = dim;
+
+    if (cur_l + reader.size() > appr_alg->max_elements_) {
+      Rcpp::stop("Index is too small to contain all items");
+    }
+    chunk_size = std::max(chunk_size, static_cast<std::size_t>(1));
+
+    std::vector<dist_t> data;
+    std::vector<dist_t> next_data;
+    std::size_t nitems = reader.read(data, chunk_size);
+    while (nitems > 0) {
+      auto next_nitems = std::async(std::launch::async, [&]() {
+        return reader.read(next_data, chunk_size);
+      });
+
+      addItemsColImpl(data.data(), nitems, ndim);
+
+      nitems = next_nitems.get();
+      std::swap(data, next_data);
+    }
+  }
+
+  // Sparse items are the columns of an ndim x nitems dgCMatrix, passed as its
+  // row indices i, column pointers p and values x. Only for the sparse spaces,
+  // which store each item's indices and values in the space's arena
+  void addItemsSparseCol(const Rcpp::IntegerVector &i,
+                         const Rcpp::IntegerVector &p,
+                         const Rcpp::NumericVector &x) {
+    const std::size_t nitems = checkSparseItems(i, p, x);
+    const std::size_t index_start = cur_l;
+    if (index_start + nitems > appr_alg->max_elements_) {
+      Rcpp::stop("Index is too small to contain all items");
+    }
+
+    const int *rows = i.begin();
+    const int *cols = p.begin();
+    const double *values = x.begin();
+    if (deterministic) {
+      auto write_item = [&](std::size_t j, void *dest) -> hnswlib::labeltype {
+        std::vector<unsigned int> item_indices;
+        std::vector<dist_t> item_values;
+        sparseItem(rows, cols, values, j, item_indices, item_values);
+        hnswlib::SparseVector item = space->arena().add(
+            item_indices.data(), item_values.data(), item_indices.size());
+        memcpy(dest, &item, sizeof(item));
+        return index_start + j;
+      };
+      appr_alg->addPointsDeterministic(nitems, write_item, numThreads);
+      cur_l = size();
+      return;
+    }
+
+    auto worker = [&](std::size_t begin, std::size_t end) {
+      std::vector<unsigned int> item_indices;
+      std::vector<dist_t> item_values;
+      for (auto j = begin; j < end; j++) {
+        sparseItem(rows, cols, values, j, item_indices, item_values);
+        hnswlib::SparseVector item = space->arena().add(
+            item_indices.data(), item_values.data(), item_indices.size());
+        appr_alg->addPoint(&item, index_start + j);
+      }
+    };
+    pforr::parallel_for(0, nitems, worker, numThreads, grainSize);
+    cur_l = size();
+  }
+
+  // checks the slots of a dgCMatrix passed to the sparse methods and returns
+  // the number of items (columns) in it
+  auto checkSparseItems(const Rcpp::IntegerVector &i,
+                        const Rcpp::IntegerVector &p,
+                        const Rcpp::NumericVector &x) -> std::size_t {
+    const std::size_t nnz = i.size();
+    if (p.size() < 1 || static_cast<std::size_t>(x.size()) != nnz ||
+        p.begin()[0] != 0 ||
+        static_cast<std::size_t>(p.begin()[p.size() - 1]) != nnz) {
+      Rcpp::stop("Sparse items are malformed");
+    }
+    const std::size_t nitems = p.size() - 1;
+    const int *rows = i.begin();
+    const int *cols = p.begin();
+    for (std::size_t j = 0; j < nitems; j++) {
+      if (cols[j] > cols[j + 1]) {
+        Rcpp::stop("Sparse items are malformed");
+      }
+      for (int k = cols[j]; k < cols[j + 1]; k++) {
+        if (rows[k] < 0 || rows[k] >= dim) {
+          Rcpp::stop("Items to add have incorrect dimensions");
+        }
+        if (k > cols[j] && rows[k] <= rows[k - 1]) {
+          Rcpp::stop("Sparse items must have increasing row indices");
+        }
+      }
+    }
+    return nitems;
+  }
+
+  // copies the indices and values of sparse item j, normalizing the values if
+  // needed
+  static void sparseItem(const int *rows, const int *cols,
+                         const double *values, std::size_t j,
+                         std::vector<unsigned int> &item_indices,
+                         std::vector<dist_t> &item_values) {
+    item_indices.assign(rows + cols[j], rows + cols[j + 1]);
+    item_values.assign(values + cols[j], values + cols[j + 1]);
+    Normalizer<dist_t, DoNormalize>::normalize(item_values);
+  }
+
   auto getNNs(const std::vector<dist_t> &item, std::size_t nnbrs)
       -> std::vector<hnswlib::labeltype> {
     std::vector<dist_t> item_copy(item);
@@ -222,52 +458,32 @@ public:
   auto getNNsImpl(std::vector<dist_t> &item, std::size_t nnbrs,
                   bool include_distances, std::vector<dist_t> &distances,
                   bool &found_all) -> std::vector<hnswlib::labeltype> {
-    found_all = true;
     Normalizer<dist_t, DoNormalize>::normalize(item);
 
-    std::priority_queue<std::pair<dist_t, hnswlib::labeltype>> result =
-        appr_alg->searchKnn(item.data(), nnbrs);
+    return searchImpl(item.data(), nnbrs, include_distances, distances,
+                      found_all);
+  }
 
-    const std::size_t nresults = result.size();
-    if (nresults != nnbrs) {
-      found_all = false;
-    }
+  // item is in the form stored in the index, i.e. already normalized
+  auto searchImpl(const void *item, std::size_t nnbrs, bool include_distances,
+                  std::vector<dist_t> &distances, bool &found_all)
+      -> std::vector<hnswlib::labeltype> {
+    std::vector<hnswlib::labeltype> items(nnbrs);
+    distances.resize(nnbrs);
 
-    std::vector<hnswlib::labeltype> items;
-    items.reserve(nnbrs);
+    const std::size_t nresults = appr_alg->searchKnn(
+        item, nnbrs, search_scratch, items.data(), distances.data());
+    found_all = nresults == nnbrs;
 
-    if (include_distances) {
-      distances.reserve(nnbrs);
+    for (std::size_t i = 0; i < nresults; i++) {
+      items[i] += 1;
+    }
+    for (std::size_t i = nresults; i < nnbrs; i++) {
+      distances[i] = (std::numeric_limits<dist_t>::max)();
+      items[i] = -1;
+    }
+    if (!include_distances) {
       distances.clear();
-
-      for (std::size_t i = 0; i < nresults; i++) {
-        auto &result_tuple = result.top();
-        distances.push_back(result_tuple.first);
-        items.push_back(result_tuple.second + 1);
-        result.pop();
-      }
-      if (!found_all) {
-        for (std::size_t i = 0; i != nnbrs - nresults; i++) {
-          distances.push_back((std::numeric_limits<dist_t>::max)());
-          items.push_back(-1);
-        }
-      }
-
-      std::reverse(distances.begin(), distances.end());
-      std::reverse(items.begin(), items.end());
-    } else {
-      for (std::size_t i = 0; i < nresults; i++) {
-        auto &result_tuple = result.top();
-        items.push_back(result_tuple.second + 1);
-        result.pop();
-      }
-      if (!found_all) {
-        for (std::size_t i = 0; i != nnbrs - nresults; i++) {
-          items.push_back(-1);
-        }
-      }
-
-      std::reverse(items.begin(), items.end());
     }
 
     return items;
@@ -280,40 +496,65 @@ public:
     return getNNsImpl(item, nnbrs, include_distances, distances, found_all);
   }
 
-  auto getAllNNsListImpl(const std::vector<dist_t> &data, std::size_t nitems,
-                         std::size_t ndim, std::size_t nnbrs,
-                         bool include_distances,
-                         std::vector<hnswlib::labeltype> &idx_vec,
-                         std::vector<dist_t> &dist_vec) -> bool {
+  // data is the nitems x ndim matrix of items to search, stored column-wise
+  // as in R. The labels are written to idx and, unless it is null, the
+  // processed distances to dist, both nitems x nnbrs column-wise matrices
+  template <typename T, typename D>
+  auto getAllNNsListImpl(const T *data, std::size_t nitems, std::size_t ndim,
+                         std::size_t nnbrs, int *idx, D *dist) -> bool {
+    auto make_query = [&]() {
+      return [&, item_copy = std::vector<dist_t>(ndim)](
+                 std::size_t i) mutable -> const void * {
+        for (std::size_t j = 0; j < ndim; j++) {
+          item_copy[j] = data[j * nitems + i];
+        }
+        Normalizer<dist_t, DoNormalize>::normalize(item_copy);
+        return item_copy.data();
+      };
+    };
+    return searchAllImpl(nitems, nnbrs, make_query, idx, dist, 1, nitems);
+  }
+
+  // Searches nitems items in parallel. make_query creates a function for
+  // each worker, which returns item i in the form stored in the index,
+  // using its own scratch space. The labels of the neighbors of item i are
+  // written to idx[i * item_stride + k * nbr_stride] for k in [0, nnbrs)
+  // and, unless dist is null, the processed distances to the same positions
+  // of dist
+  template <typename MakeQuery, typename D>
+  auto searchAllImpl(std::size_t nitems, std::size_t nnbrs,
+                     MakeQuery make_query, int *idx, D *dist,
+                     std::size_t item_stride, std::size_t nbr_stride)
+      -> bool {
+    const bool include_distances = dist != nullptr;
     // race condition for writing found_all false, but it is never read from
     // until after the threaded section, so it doesn't matter
     bool found_all = true;
 
+    // the scratch space and result buffers are reused for every item the
+    // worker searches, so the search itself does no allocation
     auto worker = [&](std::size_t begin, std::size_t end) {
-      std::vector<dist_t> item_copy(ndim);
-      std::vector<dist_t> distances(0);
+      auto query = make_query();
+      typename Index::SearchScratch scratch;
+      std::vector<hnswlib::labeltype> labels(nnbrs);
+      std::vector<dist_t> distances(nnbrs);
 
       for (auto i = begin; i < end; i++) {
-        for (std::size_t j = 0; j < ndim; j++) {
-          item_copy[j] = data[j * nitems + i];
-        }
-
-        bool ok_row = true;
-        std::vector<hnswlib::labeltype> nbr_labels =
-            getNNsImpl(item_copy, nnbrs, include_distances, distances, ok_row);
-        if (!ok_row) {
+        const std::size_t nresults = appr_alg->searchKnn(
+            query(i), nnbrs, scratch, labels.data(), distances.data());
+        if (nresults != nnbrs) {
           found_all = false;
           break;
         }
 
+        for (std::size_t k = 0; k < nnbrs; k++) {
+          idx[i * item_stride + k * nbr_stride] =
+              static_cast<int>(labels[k] + 1);
+        }
         if (include_distances) {
           for (std::size_t k = 0; k < nnbrs; k++) {
-            idx_vec[k * nitems + i] = nbr_labels[k];
-            dist_vec[k * nitems + i] = distances[k];
-          }
-        } else {
-          for (std::size_t k = 0; k < nnbrs; k++) {
-            idx_vec[k * nitems + i] = nbr_labels[k];
+            dist[i * item_stride + k * nbr_stride] =
+                DistanceProcess::process_distance(distances[k]);
           }
         }
       }
@@ -332,23 +573,38 @@ public:
       Rcpp::stop("Items to add have incorrect dimensions");
     }
 
-    auto data = Rcpp::as<std::vector<dist_t>>(items);
+    return getAllNNsListFromData(items.begin(), nitems, nnbrs,
+                                 include_distances);
+  }
 
-    std::vector<hnswlib::labeltype> idx_vec(nitems * nnbrs);
-    std::vector<dist_t> dist_vec(include_distances ? nitems * nnbrs : 0);
-    bool found_all = getAllNNsListImpl(data, nitems, ndim, nnbrs,
-                                       include_distances, idx_vec, dist_vec);
+  // items: float32 values of an nitems * ndim matrix (see float32_data)
+  auto getAllNNsListFloat(SEXP items, std::size_t nitems, std::size_t nnbrs,
+                          bool include_distances) -> Rcpp::List {
+    return getAllNNsListFromData(float32_data(items, nitems * dim), nitems,
+                                 nnbrs, include_distances);
+  }
+
+  // data: nitems * ndim, stored column-wise as in R
+  template <typename T>
+  auto getAllNNsListFromData(const T *data, int nitems, std::size_t nnbrs,
+                             bool include_distances) -> Rcpp::List {
+    // results are written by the workers directly into the returned matrices
+    Rcpp::IntegerMatrix idx =
+        Rcpp::no_init_matrix(nitems, static_cast<int>(nnbrs));
+    Rcpp::NumericMatrix dist;
+    if (include_distances) {
+      dist = Rcpp::no_init_matrix(nitems, static_cast<int>(nnbrs));
+    }
+    bool found_all =
+        getAllNNsListImpl(data, nitems, dim, nnbrs, idx.begin(),
+                          include_distances ? dist.begin() : nullptr);
     if (!found_all) {
       Rcpp::stop("Unable to find nnbrs results. Probably ef or M is too small");
     }
 
-    auto result = Rcpp::List::create(
-        Rcpp::Named("item") = Rcpp::IntegerMatrix(
-            nitems, static_cast<int>(nnbrs), idx_vec.begin()));
+    auto result = Rcpp::List::create(Rcpp::Named("item") = idx);
     if (include_distances) {
-      DistanceProcess::process_distances(dist_vec);
-      result["distance"] = Rcpp::NumericMatrix(nitems, static_cast<int>(nnbrs),
-                                               dist_vec.begin());
+      result["distance"] = dist;
     }
     return result;
   }
@@ -357,17 +613,17 @@ public:
       -> Rcpp::IntegerMatrix {
     auto nitems = items.nrow();
     const std::size_t ndim = items.ncol();
-    auto data = Rcpp::as<std::vector<dist_t>>(items);
+    const double *data = items.begin();
 
-    std::vector<hnswlib::labeltype> idx_vec(nitems * nnbrs);
-    std::vector<dist_t> dist_vec(0);
-    bool found_all =
-        getAllNNsListImpl(data, nitems, ndim, nnbrs, false, idx_vec, dist_vec);
+    Rcpp::IntegerMatrix idx =
+        Rcpp::no_init_matrix(nitems, static_cast<int>(nnbrs));
+    bool found_all = getAllNNsListImpl(data, nitems, ndim, nnbrs, idx.begin(),
+                                       static_cast<double *>(nullptr));
     if (!found_all) {
       Rcpp::stop("Unable to find nnbrs results. Probably ef or M is too small");
     }
 
-    return {nitems, static_cast<int>(nnbrs), idx_vec.begin()};
+    return idx;
   }
 
   auto getAllNNsListCol(const Rcpp::NumericMatrix &items, std::size_t nnbrs,
@@ -378,23 +634,38 @@ public:
       Rcpp::stop("Items to add have incorrect dimensions");
     }
 
-    auto data = Rcpp::as<std::vector<dist_t>>(items);
+    return getAllNNsListColFromData(items.begin(), nitems, nnbrs,
+                                    include_distances);
+  }
 
-    std::vector<hnswlib::labeltype> idx_vec(nitems * nnbrs);
-    std::vector<dist_t> dist_vec(include_distances ? nitems * nnbrs : 0);
-    bool found_all = getAllNNsListColImpl(data, nitems, ndim, nnbrs,
-                                          include_distances, idx_vec, dist_vec);
+  // items: float32 values of an ndim * nitems matrix (see float32_data)
+  auto getAllNNsListColFloat(SEXP items, std::size_t nitems,
+                             std::size_t nnbrs, bool include_distances)
+      -> Rcpp::List {
+    return getAllNNsListColFromData(float32_data(items, dim * nitems), nitems,
+                                    nnbrs, include_distances);
+  }
+
+  // data: ndim * nitems, i.e. each item is stored contiguously
+  template <typename T>
+  auto getAllNNsListColFromData(const T *data, int nitems, std::size_t nnbrs,
+                                bool include_distances) -> Rcpp::List {
+    Rcpp::IntegerMatrix idx =
+        Rcpp::no_init_matrix(static_cast<int>(nnbrs), nitems);
+    Rcpp::NumericMatrix dist;
+    if (include_distances) {
+      dist = Rcpp::no_init_matrix(static_cast<int>(nnbrs), nitems);
+    }
+    bool found_all =
+        getAllNNsListColImpl(data, nitems, dim, nnbrs, idx.begin(),
+                             include_distances ? dist.begin() : nullptr);
     if (!found_all) {
       Rcpp::stop("Unable to find nnbrs results. Probably ef or M is too small");
     }
 
-    auto result = Rcpp::List::create(
-        Rcpp::Named("item") = Rcpp::IntegerMatrix(static_cast<int>(nnbrs),
-                                                  nitems, idx_vec.begin()));
+    auto result = Rcpp::List::create(Rcpp::Named("item") = idx);
     if (include_distances) {
-      DistanceProcess::process_distances(dist_vec);
-      result["distance"] = Rcpp::NumericMatrix(static_cast<int>(nnbrs), nitems,
-                                               dist_vec.begin());
+      result["distance"] = dist;
     }
     return result;
   }
@@ -403,78 +674,175 @@ public:
       -> Rcpp::IntegerMatrix {
     auto nitems = items.ncol();
     const std::size_t ndim = items.nrow();
-    auto data = Rcpp::as<std::vector<dist_t>>(items);
+    const double *data = items.begin();
 
-    std::vector<hnswlib::labeltype> idx_vec(nitems * nnbrs);
-    std::vector<dist_t> dist_vec(0);
-    bool found_all = getAllNNsListColImpl(data, nitems, ndim, nnbrs, false,
-                                          idx_vec, dist_vec);
+    Rcpp::IntegerMatrix idx =
+        Rcpp::no_init_matrix(static_cast<int>(nnbrs), nitems);
+    bool found_all = getAllNNsListColImpl(data, nitems, ndim, nnbrs,
+                                          idx.begin(),
+                                          static_cast<double *>(nullptr));
     if (!found_all) {
       Rcpp::stop("Unable to find nnbrs results. Probably ef or M is too small");
     }
 
-    return {static_cast<int>(nnbrs), nitems, idx_vec.begin()};
+    return idx;
   }
 
-  auto getAllNNsListColImpl(const std::vector<dist_t> &data, std::size_t nitems,
-                            std::size_t ndim, std::size_t nnbrs,
-                            bool include_distances,
-                            std::vector<hnswlib::labeltype> &idx_vec,
-                            std::vector<dist_t> &dist_vec) -> bool {
-    // race condition for writing found_all false, but it is never read from
-    // until after the threaded section, so it doesn't matter
-    bool found_all = true;
-    auto data_begin = data.cbegin();
+  // Sparse items are passed as in addItemsSparseCol. Nearest Neighbors data
+  // is returned column-wise
+  auto getAllNNsListSparseCol(const Rcpp::IntegerVector &i,
+                              const Rcpp::IntegerVector &p,
+                              const Rcpp::NumericVector &x, std::size_t nnbrs,
+                              bool include_distances) -> Rcpp::List {
+    const std::size_t nitems = checkSparseItems(i, p, x);
+
+    const int *rows = i.begin();
+    const int *cols = p.begin();
+    const double *values = x.begin();
+    auto make_query = [&]() {
+      return [&, item_indices = std::vector<unsigned int>(),
+              item_values = std::vector<dist_t>(),
+              item = hnswlib::SparseVector()](std::size_t j) mutable
+             -> const void * {
+        sparseItem(rows, cols, values, j, item_indices, item_values);
+        item = {item_indices.data(), item_values.data(), item_indices.size()};
+        return &item;
+      };
+    };
 
-    auto worker = [&](std::size_t begin, std::size_t end) {
-      std::vector<dist_t> distances(0);
+    Rcpp::IntegerMatrix idx = Rcpp::no_init_matrix(static_cast<int>(nnbrs),
+                                                   static_cast<int>(nitems));
+    Rcpp::NumericMatrix dist;
+    if (include_distances) {
+      dist = Rcpp::no_init_matrix(static_cast<int>(nnbrs),
+                                  static_cast<int>(nitems));
+    }
+    bool found_all = searchAllImpl(nitems, nnbrs, make_query, idx.begin(),
+                                   include_distances ? dist.begin() : nullptr,
+                                   nnbrs, 1);
+    if (!found_all) {
+      Rcpp::stop("Unable to find nnbrs results. Probably ef or M is too small");
+    }
 
-      for (auto i = begin; i < end; i++) {
-        auto first = data_begin + ndim * i;
-        std::vector<dist_t> item_copy(first, first + ndim);
+    auto result = Rcpp::List::create(Rcpp::Named("item") = idx);
+    if (include_distances) {
+      result["distance"] = dist;
+    }
+    return result;
+  }
 
-        bool ok_row = true;
-        std::vector<hnswlib::labeltype> nbr_labels =
-            getNNsImpl(item_copy, nnbrs, include_distances, distances, ok_row);
-        if (!ok_row) {
-          found_all = false;
-          break;
-        }
+  // data is the ndim x nitems matrix of items to search, i.e. each item is
+  // stored contiguously. The labels are written to idx and, unless it is
+  // null, the processed distances to dist, both nnbrs x nitems column-wise
+  // matrices
+  template <typename T, typename D>
+  auto getAllNNsListColImpl(const T *data, std::size_t nitems,
+                            std::size_t ndim, std::size_t nnbrs, int *idx,
+                            D *dist) -> bool {
+    auto make_query = [&]() {
+      return [&, item_copy = std::vector<dist_t>(ndim)](
+                 std::size_t i) mutable -> const void * {
+        const T *first = data + ndim * i;
+        std::copy(first, first + ndim, item_copy.begin());
+        Normalizer<dist_t, DoNormalize>::normalize(item_copy);
+        return item_copy.data();
+      };
+    };
+    return searchAllImpl(nitems, nnbrs, make_query, idx, dist, nnbrs, 1);
+  }
 
-        if (include_distances) {
-          for (std::size_t k = 0; k < nnbrs; k++) {
-            idx_vec[nnbrs * i + k] = nbr_labels[k];
-            dist_vec[nnbrs * i + k] = distances[k];
-          }
-        } else {
-          for (std::size_t k = 0; k < nnbrs; k++) {
-            idx_vec[nnbrs * i + k] = nbr_labels[k];
-          }
-        }
+  // searches the items stored in query_filename (see VecFileReader for the
+  // formats) chunk_size at a time, writing the labels of the neighbors of
+  // each item to item_filename as int32 and, unless distance_filename is
+  // empty, their distances to distance_filename as float32. Reading the next
+  // chunk and writing the results of the previous one happen while the
+  // current chunk is searched. Returns the number of items searched
+  auto searchFile(const std::string &query_filename, const std::string &format,
+                  std::size_t nnbrs, const std::string &item_filename,
+                  const std::string &distance_filename, std::size_t chunk_size)
+      -> std::size_t {
+    VecFileReader reader(query_filename, format, dim);
+    const std::size_t ndim = dim;
+    const bool include_distances = !distance_filename.empty();
+    chunk_size = std::max(chunk_size, static_cast<std::size_t>(1));
+
+    std::ofstream item_output(item_filename, std::ios::binary);
+    if (!item_output.is_open()) {
+      Rcpp::stop("Cannot open file %s", item_filename);
+    }
+    std::ofstream distance_output;
+    if (include_distances) {
+      distance_output.open(distance_filename, std::ios::binary);
+      if (!distance_output.is_open()) {
+        Rcpp::stop("Cannot open file %s", distance_filename);
       }
-    };
+    }
 
-    pforr::parallel_for(0, nitems, worker, numThreads, grainSize);
+    std::vector<dist_t> data;
+    std::vector<dist_t> next_data;
+    std::vector<int32_t> idx_vec;
+    std::vector<int32_t> written_idx_vec;
+    std::vector<float> dist_vec;
+    std::vector<float> written_dist_vec;
+    std::future<void> written;
+
+    std::size_t nsearched = 0;
+    std::size_t nitems = reader.read(data, chunk_size);
+    while (nitems > 0) {
+      auto next_nitems = std::async(std::launch::async, [&]() {
+        return reader.read(next_data, chunk_size);
+      });
+
+      idx_vec.resize(nitems * nnbrs);
+      dist_vec.resize(include_distances ? nitems * nnbrs : 0);
+      bool found_all = getAllNNsListColImpl(
+          data.data(), nitems, ndim, nnbrs, idx_vec.data(),
+          include_distances ? dist_vec.data() : nullptr);
+      if (!found_all) {
+        Rcpp::stop(
+            "Unable to find nnbrs results. Probably ef or M is too small");
+      }
 
-    return found_all;
+      if (written.valid()) {
+        written.get();
+      }
+      std::swap(idx_vec, written_idx_vec);
+      std::swap(dist_vec, written_dist_vec);
+      written = std::async(std::launch::async, [&]() {
+        write_vec_file<int32_t>(item_output, written_idx_vec);
+        if (include_distances) {
+          write_vec_file<float>(distance_output, written_dist_vec);
+        }
+      });
+
+      nsearched += nitems;
+      nitems = next_nitems.get();
+      std::swap(data, next_data);
+    }
+    if (written.valid()) {
+      written.get();
+    }
+    return nsearched;
   }
 
-  auto getItemsImpl(const std::vector<hnswlib::labeltype> &ids)
-      -> std::vector<dist_t> {
-    // this method assumes all the ids are valid
+  // writes the items with the given labels to the nitems x dim column-wise
+  // matrix data. This assumes all the ids are valid and that the index isn't
+  // being modified at the same time
+  void getItemsImpl(const std::vector<hnswlib::labeltype> &ids, double *data) {
     const std::size_t nitems = ids.size();
-    std::vector<dist_t> data(dim * nitems);
+    const std::size_t ndim = dim;
 
     auto worker = [&](std::size_t begin, std::size_t end) {
       for (std::size_t i = begin; i != end; i++) {
-        auto obs = appr_alg->template getDataByLabel<dist_t>(ids[i]);
-        std::copy(obs.begin(), obs.end(), data.begin() + i * dim);
+        auto obs = reinterpret_cast<const dist_t *>(
+            appr_alg->getDataPtrByLabel(ids[i]));
+        for (std::size_t j = 0; j < ndim; j++) {
+          data[j * nitems + i] = obs[j];
+        }
       }
     };
 
     pforr::parallel_for(0, nitems, worker, numThreads, grainSize);
-
-    return data;
   }
 
   auto getItems(const Rcpp::IntegerVector &ids) -> Rcpp::NumericMatrix {
@@ -491,21 +859,87 @@ public:
       ids_[i] = idx;
     }
 
-    std::vector<dist_t> data = getItemsImpl(ids_);
+    Rcpp::NumericMatrix data = Rcpp::no_init_matrix(nitems, dim);
+    getItemsImpl(ids_, data.begin());
 
-    return Rcpp::transpose(Rcpp::NumericMatrix(dim, nitems, data.begin()));
+    return data;
   }
 
   void callSave(const std::string &path_to_index) {
+    waitSave();
     appr_alg->saveIndex(path_to_index);
   }
 
+  // starts saving a snapshot of the index to file in the background: only
+  // one save can be pending, so this waits for any previous one to finish.
+  // reorder and useAlignedLayout also wait for it, because they invalidate
+  // the checkpoint it commits
+  void callSaveAsync(const std::string &path_to_index) {
+    waitSave();
+    pending_save = appr_alg->saveIndexAsync(path_to_index);
+  }
+
+  auto isSaveDone() const -> bool {
+    return !pending_save.valid() ||
+           pending_save.wait_for(std::chrono::seconds(0)) ==
+               std::future_status::ready;
+  }
+
+  // blocks until the pending save finishes, reporting any error from writing
+  void waitSave() {
+    if (!pending_save.valid()) {
+      return;
+    }
+    try {
+      appr_alg->commitCheckpoint(pending_save.get());
+    } catch (const std::exception &e) {
+      // the checkpoint isn't committed, so the next incremental save is full
+      Rcpp::stop("Background save failed: %s", e.what());
+    }
+  }
+
+  // appends the changes since the last save or load to a log file next to
+  // the index, which is read when the index is loaded. callSave compacts the
+  // index and the log back into one file
+  void callSaveIncremental(const std::string &path_to_index) {
+    waitSave();
+    appr_alg->saveIndexIncremental(path_to_index);
+  }
+
+  // returns the index in the same format as callSave writes to file
+  auto serialize() -> Rcpp::RawVector {
+    waitSave();
+    Rcpp::RawVector buffer(appr_alg->indexFileSize());
+    appr_alg->saveIndexToBuffer(reinterpret_cast<char *>(buffer.begin()));
+    return buffer;
+  }
+
+  // replaces the current index with one created by serialize
+  void deserialize(const Rcpp::RawVector &buffer) {
+    waitSave();
+    std::unique_ptr<Index> loaded(new Index(space.get()));
+    loaded->useDenseLabels();
+    loaded->loadIndexFromBuffer(reinterpret_cast<const char *>(buffer.begin()),
+                                buffer.size(), space.get(), 0, numThreads);
+    appr_alg = std::move(loaded);
+    cur_l = size();
+    useDenseLabels();
+  }
+
+  auto getDim() const -> int { return dim; }
+
   auto size() const -> std::size_t { return appr_alg->cur_element_count; }
 
   void setNumThreads(std::size_t numThreads) { this->numThreads = numThreads; }
 
   void setGrainSize(std::size_t grainSize) { this->grainSize = grainSize; }
 
+  // if true, items are added so that the index is the same whatever the
+  // number of threads (see hnswlib::HierarchicalNSW::addPointsDeterministic)
+  void setDeterministic(bool deterministic) {
+    this->deterministic = deterministic;
+  }
+
   void markDeleted(std::size_t label) {
     if (label < 1 || label > size()) {
       Rcpp::stop("Bad label");
@@ -516,16 +950,80 @@ public:
 
   void resizeIndex(std::size_t new_size) { appr_alg->resizeIndex(new_size); }
 
+  // renumbers the items internally to make searching more cache-friendly.
+  // Labels are unchanged
+  void reorder() {
+    waitSave();
+    appr_alg->reorder(numThreads);
+  }
+
+  // makes the index read-only and releases the memory only needed to modify it
+  void freeze() { appr_alg->freeze(); }
+
+  // freezes the index and compresses the links of its bottom layer
+  void compressLinks() { appr_alg->compressLinks(numThreads); }
+
+  // stores the vectors and labels apart from the graph links, so searching
+  // reads less unrelated memory
+  void useSeparateStorage() { appr_alg->useSeparateStorage(numThreads); }
+
+  // pads each item so its vector starts on a cache line. Best called before
+  // adding items
+  void useAlignedLayout() {
+    waitSave();
+    appr_alg->useAlignedLayout(numThreads);
+  }
+
 private:
+  // with dense labels enabled before the index is read, loading puts each
+  // label straight into its slot of the label array rather than building a
+  // hash table first
+  auto readIndex(const std::string &path_to_index, std::size_t max_elements,
+                 std::size_t n_threads) -> std::unique_ptr<Index> {
+    if constexpr (std::is_same<Index, hnswlib::HierarchicalNSW<dist_t>>::value) {
+      std::unique_ptr<Index> index(new Index(space.get()));
+      index->useDenseLabels();
+      index->loadIndex(path_to_index, space.get(), max_elements, n_threads);
+      return index;
+    } else {
+      return std::unique_ptr<Index>(new Index(space.get(), path_to_index));
+    }
+  }
+
+  // the labels used here are always 0 to size() - 1, so (unless a loaded
+  // index was created elsewhere with other labels) the index can look them up
+  // in an array rather than a locked hash table
+  void useDenseLabels() {
+    if constexpr (std::is_same<Index, hnswlib::HierarchicalNSW<dist_t>>::value) {
+      appr_alg->useDenseLabels();
+    }
+  }
+
   int dim;
   bool normalize;
   hnswlib::labeltype cur_l;
   std::size_t numThreads;
   std::size_t grainSize;
+  bool deterministic{false};
   std::unique_ptr<Distance> space;
-  std::unique_ptr<hnswlib::HierarchicalNSW<dist_t>> appr_alg;
+  std::unique_ptr<Index> appr_alg;
+  std::future<hnswlib::IndexCheckpoint> pending_save;
+  // single item searches only run on the R thread, so they can all share one
+  // scratch space rather than allocating a visited list per query
+  typename Index::SearchScratch search_scratch;
 };
 
+// Rcpp dispatches constructors on the number of arguments only, so these tell
+// apart the four-argument constructors that create a new index from the one
+// that loads an index from a file
+auto is_new_index_args(SEXP *args, int nargs) -> bool {
+  return nargs == 4 && TYPEOF(args[1]) != STRSXP;
+}
+
+auto is_load_index_args(SEXP *args, int nargs) -> bool {
+  return nargs == 4 && TYPEOF(args[1]) == STRSXP;
+}
+
 using HnswL2 = Hnsw<float, hnswlib::L2Space, false, NoDistanceProcess>;
 using HnswCosine =
     Hnsw<float, hnswlib::InnerProductSpace, true, NoDistanceProcess>;
@@ -534,29 +1032,74 @@ using HnswIp =
 using HnswEuclidean =
     Hnsw<float, hnswlib::L2Space, false, SquareRootDistanceProcess>;
 
+using HnswSparseL2 =
+    Hnsw<float, hnswlib::SparseL2Space, false, NoDistanceProcess>;
+using HnswSparseCosine =
+    Hnsw<float, hnswlib::SparseInnerProductSpace, true, NoDistanceProcess>;
+using HnswSparseIp =
+    Hnsw<float, hnswlib::SparseInnerProductSpace, false, NoDistanceProcess>;
+using HnswSparseEuclidean =
+    Hnsw<float, hnswlib::SparseL2Space, false, SquareRootDistanceProcess>;
+
+using HnswL2Disk = Hnsw<float, hnswlib::L2Space, false, NoDistanceProcess,
+                        hnswlib::HierarchicalNSWDisk<float>>;
+using HnswCosineDisk =
+    Hnsw<float, hnswlib::InnerProductSpace, true, NoDistanceProcess,
+         hnswlib::HierarchicalNSWDisk<float>>;
+using HnswIpDisk =
+    Hnsw<float, hnswlib::InnerProductSpace, false, NoDistanceProcess,
+         hnswlib::HierarchicalNSWDisk<float>>;
+using HnswEuclideanDisk =
+    Hnsw<float, hnswlib::L2Space, false, SquareRootDistanceProcess,
+         hnswlib::HierarchicalNSWDisk<float>>;
+
 RCPP_EXPOSED_CLASS_NODECL(HnswL2)
 RCPP_MODULE(HnswL2) {
   Rcpp::class_<HnswL2>("HnswL2")
       .constructor<int32_t, std::size_t, std::size_t, std::size_t>(
-          "constructor with dimension, number of items, M, ef")
+          "constructor with dimension, number of items, M, ef",
+          &is_new_index_args)
       .constructor<int32_t, std::size_t, std::size_t, std::size_t, std::size_t>(
           "constructor with dimension, number of items, M, ef, random seed")
       .constructor<int32_t, std::string>(
           "constructor with dimension, loading from filename")
       .constructor<int32_t, std::string, std::size_t>(
           "constructor with dimension, loading from filename, number of items")
+      .constructor<int32_t, std::string, std::size_t, std::size_t>(
+          "constructor with dimension, loading from filename, number of items, "
+          "number of threads",
+          &is_load_index_args)
       .method("setEf", &HnswL2::setEf, "set ef value")
       .method("addItem", &HnswL2::addItem, "add item")
       .method("addItems", &HnswL2::addItems,
               "add items where each item is stored row-wise")
       .method("addItemsCol", &HnswL2::addItemsCol,
               "add items where each item is stored column-wise")
+      .method("addItemsFloat", &HnswL2::addItemsFloat,
+              "add float32 items where each item is stored row-wise")
+      .method("addItemsColFloat", &HnswL2::addItemsColFloat,
+              "add float32 items where each item is stored column-wise")
+      .method("addItemsFile", &HnswL2::addItemsFile,
+              "add items stored in a fvecs, bvecs or float32 file")
       .method("getItems", &HnswL2::getItems,
               "returns a matrix of vectors with the integer identifiers "
               "specified in ids vector. "
               "Note that for cosine similarity, "
               "normalized vectors are returned")
       .method("save", &HnswL2::callSave, "save index to file")
+      .method("saveAsync", &HnswL2::callSaveAsync,
+              "start saving index to file in the background")
+      .method("isSaveDone", &HnswL2::isSaveDone,
+              "check if the background save has finished")
+      .method("waitSave", &HnswL2::waitSave,
+              "wait for the background save to finish")
+      .method("saveIncremental", &HnswL2::callSaveIncremental,
+              "save changes since the last save to a log file next to the "
+              "index file")
+      .method("serialize", &HnswL2::serialize, "save index to a raw vector")
+      .method("deserialize", &HnswL2::deserialize,
+              "replace the index with one stored in a raw vector")
+      .method("dim", &HnswL2::getDim, "dimension of the items in the index")
       .method("getNNs", &HnswL2::getNNs,
               "retrieve Nearest Neigbours given vector")
       .method("getNNsList", &HnswL2::getNNsList,
@@ -575,40 +1118,86 @@ RCPP_MODULE(HnswL2) {
               "retrieve Nearest Neigbours given matrix where items are stored "
               "column-wise. Nearest Neighbors data is also returned "
               "column-wise")
+      .method("getAllNNsListFloat", &HnswL2::getAllNNsListFloat,
+              "retrieve Nearest Neigbours given float32 matrix where items "
+              "are stored row-wise")
+      .method("getAllNNsListColFloat", &HnswL2::getAllNNsListColFloat,
+              "retrieve Nearest Neigbours given float32 matrix where items "
+              "are stored column-wise. Nearest Neighbors data is also "
+              "returned column-wise")
+      .method("searchFile", &HnswL2::searchFile,
+              "retrieve Nearest Neighbours of items stored in a file, writing "
+              "the results to files")
       .method("size", &HnswL2::size, "number of items added to the index")
       .method("setNumThreads", &HnswL2::setNumThreads,
               "set the number of threads to use")
       .method("setGrainSize", &HnswL2::setGrainSize,
               "set minimum grain size for using multiple threads")
+      .method("setDeterministic", &HnswL2::setDeterministic,
+              "add items the same way whatever the number of threads")
       .method("markDeleted", &HnswL2::markDeleted,
               "remove the item with the specified label from the index")
       .method("resizeIndex", &HnswL2::resizeIndex,
-              "resize the index to use this number of items");
+              "resize the index to use this number of items")
+      .method("reorder", &HnswL2::reorder,
+              "reorder the items in memory to speed up searching")
+      .method("freeze", &HnswL2::freeze,
+              "make the index read-only and compact it for searching")
+      .method("compressLinks", &HnswL2::compressLinks,
+              "freeze the index and compress its links")
+      .method("useSeparateStorage", &HnswL2::useSeparateStorage,
+              "store the vectors apart from the graph links")
+      .method("useAlignedLayout", &HnswL2::useAlignedLayout,
+              "align the vector of each item to a cache line");
 }
 
 RCPP_EXPOSED_CLASS_NODECL(HnswCosine)
 RCPP_MODULE(HnswCosine) {
   Rcpp::class_<HnswCosine>("HnswCosine")
       .constructor<int32_t, std::size_t, std::size_t, std::size_t>(
-          "constructor with dimension, number of items, M, ef")
+          "constructor with dimension, number of items, M, ef",
+          &is_new_index_args)
       .constructor<int32_t, std::size_t, std::size_t, std::size_t, std::size_t>(
           "constructor with dimension, number of items, M, ef, random seed")
       .constructor<int32_t, std::string>(
           "constructor with dimension, loading from filename")
       .constructor<int32_t, std::string, std::size_t>(
           "constructor with dimension, loading from filename, number of items")
+      .constructor<int32_t, std::string, std::size_t, std::size_t>(
+          "constructor with dimension, loading from filename, number of items, "
+          "number of threads",
+          &is_load_index_args)
       .method("setEf", &HnswCosine::setEf, "set ef value")
       .method("addItem", &HnswCosine::addItem, "add item")
       .method("addItems", &HnswCosine::addItems,
               "add items where each item is stored row-wise")
       .method("addItemsCol", &HnswCosine::addItemsCol,
               "add items where each item is stored column-wise")
+      .method("addItemsFloat", &HnswCosine::addItemsFloat,
+              "add float32 items where each item is stored row-wise")
+      .method("addItemsColFloat", &HnswCosine::addItemsColFloat,
+              "add float32 items where each item is stored column-wise")
+      .method("addItemsFile", &HnswCosine::addItemsFile,
+              "add items stored in a fvecs, bvecs or float32 file")
       .method("getItems", &HnswCosine::getItems,
               "returns a matrix of vectors with the integer identifiers "
               "specified in ids vector. "
               "Note that for cosine similarity, "
               "normalized vectors are returned")
       .method("save", &HnswCosine::callSave, "save index to file")
+      .method("saveAsync", &HnswCosine::callSaveAsync,
+              "start saving index to file in the background")
+      .method("isSaveDone", &HnswCosine::isSaveDone,
+              "check if the background save has finished")
+      .method("waitSave", &HnswCosine::waitSave,
+              "wait for the background save to finish")
+      .method("saveIncremental", &HnswCosine::callSaveIncremental,
+              "save changes since the last save to a log file next to the "
+              "index file")
+      .method("serialize", &HnswCosine::serialize, "save index to a raw vector")
+      .method("deserialize", &HnswCosine::deserialize,
+              "replace the index with one stored in a raw vector")
+      .method("dim", &HnswCosine::getDim, "dimension of the items in the index")
       .method("getNNs", &HnswCosine::getNNs,
               "retrieve Nearest Neigbours given vector")
       .method("getNNsList", &HnswCosine::getNNsList,
@@ -627,40 +1216,86 @@ RCPP_MODULE(HnswCosine) {
               "retrieve Nearest Neigbours given matrix where items are stored "
               "column-wise. Nearest Neighbors data is also returned "
               "column-wise")
+      .method("getAllNNsListFloat", &HnswCosine::getAllNNsListFloat,
+              "retrieve Nearest Neigbours given float32 matrix where items "
+              "are stored row-wise")
+      .method("getAllNNsListColFloat", &HnswCosine::getAllNNsListColFloat,
+              "retrieve Nearest Neigbours given float32 matrix where items "
+              "are stored column-wise. Nearest Neighbors data is also "
+              "returned column-wise")
+      .method("searchFile", &HnswCosine::searchFile,
+              "retrieve Nearest Neighbours of items stored in a file, writing "
+              "the results to files")
       .method("size", &HnswCosine::size, "number of items added to the index")
       .method("setNumThreads", &HnswCosine::setNumThreads,
               "set the number of threads to use")
       .method("setGrainSize", &HnswCosine::setGrainSize,
               "set minimum grain size for using multiple threads")
+      .method("setDeterministic", &HnswCosine::setDeterministic,
+              "add items the same way whatever the number of threads")
       .method("markDeleted", &HnswCosine::markDeleted,
               "remove the item with the specified label from the index")
       .method("resizeIndex", &HnswCosine::resizeIndex,
-              "resize the index to use this number of items");
+              "resize the index to use this number of items")
+      .method("reorder", &HnswCosine::reorder,
+              "reorder the items in memory to speed up searching")
+      .method("freeze", &HnswCosine::freeze,
+              "make the index read-only and compact it for searching")
+      .method("compressLinks", &HnswCosine::compressLinks,
+              "freeze the index and compress its links")
+      .method("useSeparateStorage", &HnswCosine::useSeparateStorage,
+              "store the vectors apart from the graph links")
+      .method("useAlignedLayout", &HnswCosine::useAlignedLayout,
+              "align the vector of each item to a cache line");
 }
 
 RCPP_EXPOSED_CLASS_NODECL(HnswIp)
 RCPP_MODULE(HnswIp) {
   Rcpp::class_<HnswIp>("HnswIp")
       .constructor<int32_t, std::size_t, std::size_t, std::size_t>(
-          "constructor with dimension, number of items, M, ef")
+          "constructor with dimension, number of items, M, ef",
+          &is_new_index_args)
       .constructor<int32_t, std::size_t, std::size_t, std::size_t, std::size_t>(
           "constructor with dimension, number of items, M, ef, random seed")
       .constructor<int32_t, std::string>(
           "constructor with dimension, loading from filename")
       .constructor<int32_t, std::string, std::size_t>(
           "constructor with dimension, loading from filename, number of items")
+      .constructor<int32_t, std::string, std::size_t, std::size_t>(
+          "constructor with dimension, loading from filename, number of items, "
+          "number of threads",
+          &is_load_index_args)
       .method("setEf", &HnswIp::setEf, "set ef value")
       .method("addItem", &HnswIp::addItem, "add item")
       .method("addItems", &HnswIp::addItems,
               "add items where each item is stored row-wise")
       .method("addItemsCol", &HnswIp::addItemsCol,
               "add items where each item is stored column-wise")
+      .method("addItemsFloat", &HnswIp::addItemsFloat,
+              "add float32 items where each item is stored row-wise")
+      .method("addItemsColFloat", &HnswIp::addItemsColFloat,
+              "add float32 items where each item is stored column-wise")
+      .method("addItemsFile", &HnswIp::addItemsFile,
+              "add items stored in a fvecs, bvecs or float32 file")
       .method("getItems", &HnswIp::getItems,
               "returns a matrix of vectors with the integer identifiers "
               "specified in ids vector. "
               "Note that for cosine similarity, "
               "normalized vectors are returned")
       .method("save", &HnswIp::callSave, "save index to file")
+      .method("saveAsync", &HnswIp::callSaveAsync,
+              "start saving index to file in the background")
+      .method("isSaveDone", &HnswIp::isSaveDone,
+              "check if the background save has finished")
+      .method("waitSave", &HnswIp::waitSave,
+              "wait for the background save to finish")
+      .method("saveIncremental", &HnswIp::callSaveIncremental,
+              "save changes since the last save to a log file next to the "
+              "index file")
+      .method("serialize", &HnswIp::serialize, "save index to a raw vector")
+      .method("deserialize", &HnswIp::deserialize,
+              "replace the index with one stored in a raw vector")
+      .method("dim", &HnswIp::getDim, "dimension of the items in the index")
       .method("getNNs", &HnswIp::getNNs,
               "retrieve Nearest Neigbours given vector")
       .method("getNNsList", &HnswIp::getNNsList,
@@ -679,40 +1314,86 @@ RCPP_MODULE(HnswIp) {
               "retrieve Nearest Neigbours given matrix where items are stored "
               "column-wise. Nearest Neighbors data is also returned "
               "column-wise")
+      .method("getAllNNsListFloat", &HnswIp::getAllNNsListFloat,
+              "retrieve Nearest Neigbours given float32 matrix where items "
+              "are stored row-wise")
+      .method("getAllNNsListColFloat", &HnswIp::getAllNNsListColFloat,
+              "retrieve Nearest Neigbours given float32 matrix where items "
+              "are stored column-wise. Nearest Neighbors data is also "
+              "returned column-wise")
+      .method("searchFile", &HnswIp::searchFile,
+              "retrieve Nearest Neighbours of items stored in a file, writing "
+              "the results to files")
       .method("size", &HnswIp::size, "number of items added to the index")
       .method("setNumThreads", &HnswIp::setNumThreads,
               "set the number of threads to use")
       .method("setGrainSize", &HnswIp::setGrainSize,
               "set minimum grain size for using multiple threads")
+      .method("setDeterministic", &HnswIp::setDeterministic,
+              "add items the same way whatever the number of threads")
       .method("markDeleted", &HnswIp::markDeleted,
               "remove the item with the specified label from the index")
       .method("resizeIndex", &HnswIp::resizeIndex,
-              "resize the index to use this number of items");
+              "resize the index to use this number of items")
+      .method("reorder", &HnswIp::reorder,
+              "reorder the items in memory to speed up searching")
+      .method("freeze", &HnswIp::freeze,
+              "make the index read-only and compact it for searching")
+      .method("compressLinks", &HnswIp::compressLinks,
+              "freeze the index and compress its links")
+      .method("useSeparateStorage", &HnswIp::useSeparateStorage,
+              "store the vectors apart from the graph links")
+      .method("useAlignedLayout", &HnswIp::useAlignedLayout,
+              "align the vector of each item to a cache line");
 }
 
 RCPP_EXPOSED_CLASS_NODECL(HnswEuclidean)
 RCPP_MODULE(HnswEuclidean) {
   Rcpp::class_<HnswEuclidean>("HnswEuclidean")
       .constructor<int32_t, std::size_t, std::size_t, std::size_t>(
-          "constructor with dimension, number of items, M, ef")
+          "constructor with dimension, number of items, M, ef",
+          &is_new_index_args)
       .constructor<int32_t, std::size_t, std::size_t, std::size_t, std::size_t>(
           "constructor with dimension, number of items, M, ef, random seed")
       .constructor<int32_t, std::string>(
           "constructor with dimension, loading from filename")
       .constructor<int32_t, std::string, std::size_t>(
           "constructor with dimension, loading from filename, number of items")
+      .constructor<int32_t, std::string, std::size_t, std::size_t>(
+          "constructor with dimension, loading from filename, number of items, "
+          "number of threads",
+          &is_load_index_args)
       .method("setEf", &HnswEuclidean::setEf, "set ef value")
       .method("addItem", &HnswEuclidean::addItem, "add item")
       .method("addItems", &HnswEuclidean::addItems,
               "add items where each item is stored row-wise")
       .method("addItemsCol", &HnswEuclidean::addItemsCol,
               "add items where each item is stored column-wise")
+      .method("addItemsFloat", &HnswEuclidean::addItemsFloat,
+              "add float32 items where each item is stored row-wise")
+      .method("addItemsColFloat", &HnswEuclidean::addItemsColFloat,
+              "add float32 items where each item is stored column-wise")
+      .method("addItemsFile", &HnswEuclidean::addItemsFile,
+              "add items stored in a fvecs, bvecs or float32 file")
       .method("getItems", &HnswEuclidean::getItems,
               "returns a matrix of vectors with the integer identifiers "
               "specified in ids vector. "
               "Note that for cosine similarity, "
               "normalized vectors are returned")
       .method("save", &HnswEuclidean::callSave, "save index to file")
+      .method("saveAsync", &HnswEuclidean::callSaveAsync,
+              "start saving index to file in the background")
+      .method("isSaveDone", &HnswEuclidean::isSaveDone,
+              "check if the background save has finished")
+      .method("waitSave", &HnswEuclidean::waitSave,
+              "wait for the background save to finish")
+      .method("saveIncremental", &HnswEuclidean::callSaveIncremental,
+              "save changes since the last save to a log file next to the "
+              "index file")
+      .method("serialize", &HnswEuclidean::serialize, "save index to a raw vector")
+      .method("deserialize", &HnswEuclidean::deserialize,
+              "replace the index with one stored in a raw vector")
+      .method("dim", &HnswEuclidean::getDim, "dimension of the items in the index")
       .method("getNNs", &HnswEuclidean::getNNs,
               "retrieve Nearest Neigbours given vector")
       .method("getNNsList", &HnswEuclidean::getNNsList,
@@ -731,14 +1412,338 @@ RCPP_MODULE(HnswEuclidean) {
               "retrieve Nearest Neigbours given matrix where items are stored "
               "column-wise. Nearest Neighbors data is also returned "
               "column-wise")
+      .method("getAllNNsListFloat", &HnswEuclidean::getAllNNsListFloat,
+              "retrieve Nearest Neigbours given float32 matrix where items "
+              "are stored row-wise")
+      .method("getAllNNsListColFloat", &HnswEuclidean::getAllNNsListColFloat,
+              "retrieve Nearest Neigbours given float32 matrix where items "
+              "are stored column-wise. Nearest Neighbors data is also "
+              "returned column-wise")
+      .method("searchFile", &HnswEuclidean::searchFile,
+              "retrieve Nearest Neighbours of items stored in a file, writing "
+              "the results to files")
       .method("size", &HnswEuclidean::size,
               "number of items added to the index")
       .method("setNumThreads", &HnswEuclidean::setNumThreads,
               "set the number of threads to use")
       .method("setGrainSize", &HnswEuclidean::setGrainSize,
               "set minimum grain size for using multiple threads")
+      .method("setDeterministic", &HnswEuclidean::setDeterministic,
+              "add items the same way whatever the number of threads")
       .method("markDeleted", &HnswEuclidean::markDeleted,
               "remove the item with the specified label from the index")
       .method("resizeIndex", &HnswEuclidean::resizeIndex,
-              "resize the index to use this number of items");
+              "resize the index to use this number of items")
+      .method("reorder", &HnswEuclidean::reorder,
+              "reorder the items in memory to speed up searching")
+      .method("freeze", &HnswEuclidean::freeze,
+              "make the index read-only and compact it for searching")
+      .method("compressLinks", &HnswEuclidean::compressLinks,
+              "freeze the index and compress its links")
+      .method("useSeparateStorage", &HnswEuclidean::useSeparateStorage,
+              "store the vectors apart from the graph links")
+      .method("useAlignedLayout", &HnswEuclidean::useAlignedLayout,
+              "align the vector of each item to a cache line");
+}
+
+// Read-only indexes searched from disk: created from a file written by save
+RCPP_EXPOSED_CLASS_NODECL(HnswL2Disk)
+RCPP_EXPOSED_CLASS_NODECL(HnswCosineDisk)
+RCPP_EXPOSED_CLASS_NODECL(HnswIpDisk)
+RCPP_EXPOSED_CLASS_NODECL(HnswEuclideanDisk)
+RCPP_MODULE(HnswDisk) {
+  Rcpp::class_<HnswL2Disk>("HnswL2Disk")
+      .constructor<int32_t, std::string>(
+          "constructor with dimension, opening the index in filename")
+      .method("setEf", &HnswL2Disk::setEf, "set ef value")
+      .method("dim", &HnswL2Disk::getDim, "dimension of the items in the index")
+      .method("getNNs", &HnswL2Disk::getNNs,
+              "retrieve Nearest Neigbours given vector")
+      .method("getNNsList", &HnswL2Disk::getNNsList,
+              "retrieve Nearest Neigbours given vector")
+      .method("getAllNNs", &HnswL2Disk::getAllNNs,
+              "retrieve Nearest Neigbours given matrix where items are stored "
+              "row-wise")
+      .method("getAllNNsList", &HnswL2Disk::getAllNNsList,
+              "retrieve Nearest Neigbours given matrix where items are stored "
+              "row-wise")
+      .method("getAllNNsCol", &HnswL2Disk::getAllNNsCol,
+              "retrieve Nearest Neigbours given matrix where items are stored "
+              "column-wise. Nearest Neighbors data is also returned "
+              "column-wise")
+      .method("getAllNNsListCol", &HnswL2Disk::getAllNNsListCol,
+              "retrieve Nearest Neigbours given matrix where items are stored "
+              "column-wise. Nearest Neighbors data is also returned "
+              "column-wise")
+      .method("getAllNNsListFloat", &HnswL2Disk::getAllNNsListFloat,
+              "retrieve Nearest Neigbours given float32 matrix where items "
+              "are stored row-wise")
+      .method("getAllNNsListColFloat", &HnswL2Disk::getAllNNsListColFloat,
+              "retrieve Nearest Neigbours given float32 matrix where items "
+              "are stored column-wise. Nearest Neighbors data is also "
+              "returned column-wise")
+      .method("searchFile", &HnswL2Disk::searchFile,
+              "retrieve Nearest Neighbours of items stored in a file, writing "
+              "the results to files")
+      .method("size", &HnswL2Disk::size, "number of items in the index")
+      .method("setNumThreads", &HnswL2Disk::setNumThreads,
+              "set the number of threads to use")
+      .method("setGrainSize", &HnswL2Disk::setGrainSize,
+              "set minimum grain size for using multiple threads");
+
+  Rcpp::class_<HnswCosineDisk>("HnswCosineDisk")
+      .constructor<int32_t, std::string>(
+          "constructor with dimension, opening the index in filename")
+      .method("setEf", &HnswCosineDisk::setEf, "set ef value")
+      .method("dim", &HnswCosineDisk::getDim, "dimension of the items in the index")
+      .method("getNNs", &HnswCosineDisk::getNNs,
+              "retrieve Nearest Neigbours given vector")
+      .method("getNNsList", &HnswCosineDisk::getNNsList,
+              "retrieve Nearest Neigbours given vector")
+      .method("getAllNNs", &HnswCosineDisk::getAllNNs,
+              "retrieve Nearest Neigbours given matrix where items are stored "
+              "row-wise")
+      .method("getAllNNsList", &HnswCosineDisk::getAllNNsList,
+              "retrieve Nearest Neigbours given matrix where items are stored "
+              "row-wise")
+      .method("getAllNNsCol", &HnswCosineDisk::getAllNNsCol,
+              "retrieve Nearest Neigbours given matrix where items are stored "
+              "column-wise. Nearest Neighbors data is also returned "
+              "column-wise")
+      .method("getAllNNsListCol", &HnswCosineDisk::getAllNNsListCol,
+              "retrieve Nearest Neigbours given matrix where items are stored "
+              "column-wise. Nearest Neighbors data is also returned "
+              "column-wise")
+      .method("getAllNNsListFloat", &HnswCosineDisk::getAllNNsListFloat,
+              "retrieve Nearest Neigbours given float32 matrix where items "
+              "are stored row-wise")
+      .method("getAllNNsListColFloat", &HnswCosineDisk::getAllNNsListColFloat,
+              "retrieve Nearest Neigbours given float32 matrix where items "
+              "are stored column-wise. Nearest Neighbors data is also "
+              "returned column-wise")
+      .method("searchFile", &HnswCosineDisk::searchFile,
+              "retrieve Nearest Neighbours of items stored in a file, writing "
+              "the results to files")
+      .method("size", &HnswCosineDisk::size, "number of items in the index")
+      .method("setNumThreads", &HnswCosineDisk::setNumThreads,
+              "set the number of threads to use")
+      .method("setGrainSize", &HnswCosineDisk::setGrainSize,
+              "set minimum grain size for using multiple threads");
+
+  Rcpp::class_<HnswIpDisk>("HnswIpDisk")
+      .constructor<int32_t, std::string>(
+          "constructor with dimension, opening the index in filename")
+      .method("setEf", &HnswIpDisk::setEf, "set ef value")
+      .method("dim", &HnswIpDisk::getDim, "dimension of the items in the index")
+      .method("getNNs", &HnswIpDisk::getNNs,
+              "retrieve Nearest Neigbours given vector")
+      .method("getNNsList", &HnswIpDisk::getNNsList,
+              "retrieve Nearest Neigbours given vector")
+      .method("getAllNNs", &HnswIpDisk::getAllNNs,
+              "retrieve Nearest Neigbours given matrix where items are stored "
+              "row-wise")
+      .method("getAllNNsList", &HnswIpDisk::getAllNNsList,
+              "retrieve Nearest Neigbours given matrix where items are stored "
+              "row-wise")
+      .method("getAllNNsCol", &HnswIpDisk::getAllNNsCol,
+              "retrieve Nearest Neigbours given matrix where items are stored "
+              "column-wise. Nearest Neighbors data is also returned "
+              "column-wise")
+      .method("getAllNNsListCol", &HnswIpDisk::getAllNNsListCol,
+              "retrieve Nearest Neigbours given matrix where items are stored "
+              "column-wise. Nearest Neighbors data is also returned "
+              "column-wise")
+      .method("getAllNNsListFloat", &HnswIpDisk::getAllNNsListFloat,
+              "retrieve Nearest Neigbours given float32 matrix where items "
+              "are stored row-wise")
+      .method("getAllNNsListColFloat", &HnswIpDisk::getAllNNsListColFloat,
+              "retrieve Nearest Neigbours given float32 matrix where items "
+              "are stored column-wise. Nearest Neighbors data is also "
+              "returned column-wise")
+      .method("searchFile", &HnswIpDisk::searchFile,
+              "retrieve Nearest Neighbours of items stored in a file, writing "
+              "the results to files")
+      .method("size", &HnswIpDisk::size, "number of items in the index")
+      .method("setNumThreads", &HnswIpDisk::setNumThreads,
+              "set the number of threads to use")
+      .method("setGrainSize", &HnswIpDisk::setGrainSize,
+              "set minimum grain size for using multiple threads");
+
+  Rcpp::class_<HnswEuclideanDisk>("HnswEuclideanDisk")
+      .constructor<int32_t, std::string>(
+          "constructor with dimension, opening the index in filename")
+      .method("setEf", &HnswEuclideanDisk::setEf, "set ef value")
+      .method("dim", &HnswEuclideanDisk::getDim, "dimension of the items in the index")
+      .method("getNNs", &HnswEuclideanDisk::getNNs,
+              "retrieve Nearest Neigbours given vector")
+      .method("getNNsList", &HnswEuclideanDisk::getNNsList,
+              "retrieve Nearest Neigbours given vector")
+      .method("getAllNNs", &HnswEuclideanDisk::getAllNNs,
+              "retrieve Nearest Neigbours given matrix where items are stored "
+              "row-wise")
+      .method("getAllNNsList", &HnswEuclideanDisk::getAllNNsList,
+              "retrieve Nearest Neigbours given matrix where items are stored "
+              "row-wise")
+      .method("getAllNNsCol", &HnswEuclideanDisk::getAllNNsCol,
+              "retrieve Nearest Neigbours given matrix where items are stored "
+              "column-wise. Nearest Neighbors data is also returned "
+              "column-wise")
+      .method("getAllNNsListCol", &HnswEuclideanDisk::getAllNNsListCol,
+              "retrieve Nearest Neigbours given matrix where items are stored "
+              "column-wise. Nearest Neighbors data is also returned "
+              "column-wise")
+      .method("getAllNNsListFloat", &HnswEuclideanDisk::getAllNNsListFloat,
+              "retrieve Nearest Neigbours given float32 matrix where items "
+              "are stored row-wise")
+      .method("getAllNNsListColFloat", &HnswEuclideanDisk::getAllNNsListColFloat,
+              "retrieve Nearest Neigbours given float32 matrix where items "
+              "are stored column-wise. Nearest Neighbors data is also "
+              "returned column-wise")
+      .method("searchFile", &HnswEuclideanDisk::searchFile,
+              "retrieve Nearest Neighbours of items stored in a file, writing "
+              "the results to files")
+      .method("size", &HnswEuclideanDisk::size, "number of items in the index")
+      .method("setNumThreads", &HnswEuclideanDisk::setNumThreads,
+              "set the number of threads to use")
+      .method("setGrainSize", &HnswEuclideanDisk::setGrainSize,
+              "set minimum grain size for using multiple threads");
+}
+
+// Indexes of sparse items: these can't be saved
+RCPP_EXPOSED_CLASS_NODECL(HnswSparseL2)
+RCPP_EXPOSED_CLASS_NODECL(HnswSparseCosine)
+RCPP_EXPOSED_CLASS_NODECL(HnswSparseIp)
+RCPP_EXPOSED_CLASS_NODECL(HnswSparseEuclidean)
+RCPP_MODULE(HnswSparse) {
+  Rcpp::class_<HnswSparseL2>("HnswSparseL2")
+      .constructor<int32_t, std::size_t, std::size_t, std::size_t>(
+          "constructor with dimension, number of items, M, ef")
+      .constructor<int32_t, std::size_t, std::size_t, std::size_t, std::size_t>(
+          "constructor with dimension, number of items, M, ef, random seed")
+      .method("setEf", &HnswSparseL2::setEf, "set ef value")
+      .method("addItemsSparseCol", &HnswSparseL2::addItemsSparseCol,
+              "add items stored in the columns of a sparse matrix")
+      .method("getAllNNsListSparseCol", &HnswSparseL2::getAllNNsListSparseCol,
+              "retrieve Nearest Neigbours given items stored in the columns "
+              "of a sparse matrix. Nearest Neighbors data is also returned "
+              "column-wise")
+      .method("dim", &HnswSparseL2::getDim, "dimension of the items in the index")
+      .method("size", &HnswSparseL2::size, "number of items added to the index")
+      .method("setNumThreads", &HnswSparseL2::setNumThreads,
+              "set the number of threads to use")
+      .method("setGrainSize", &HnswSparseL2::setGrainSize,
+              "set minimum grain size for using multiple threads")
+      .method("setDeterministic", &HnswSparseL2::setDeterministic,
+              "add items the same way whatever the number of threads")
+      .method("markDeleted", &HnswSparseL2::markDeleted,
+              "remove the item with the specified label from the index")
+      .method("reorder", &HnswSparseL2::reorder,
+              "reorder the items in memory to speed up searching")
+      .method("freeze", &HnswSparseL2::freeze,
+              "make the index read-only and compact it for searching")
+      .method("compressLinks", &HnswSparseL2::compressLinks,
+              "freeze the index and compress its links")
+      .method("useSeparateStorage", &HnswSparseL2::useSeparateStorage,
+              "store the vectors apart from the graph links")
+      .method("useAlignedLayout", &HnswSparseL2::useAlignedLayout,
+              "align the vector of each item to a cache line");
+
+  Rcpp::class_<HnswSparseCosine>("HnswSparseCosine")
+      .constructor<int32_t, std::size_t, std::size_t, std::size_t>(
+          "constructor with dimension, number of items, M, ef")
+      .constructor<int32_t, std::size_t, std::size_t, std::size_t, std::size_t>(
+          "constructor with dimension, number of items, M, ef, random seed")
+      .method("setEf", &HnswSparseCosine::setEf, "set ef value")
+      .method("addItemsSparseCol", &HnswSparseCosine::addItemsSparseCol,
+              "add items stored in the columns of a sparse matrix")
+      .method("getAllNNsListSparseCol", &HnswSparseCosine::getAllNNsListSparseCol,
+              "retrieve Nearest Neigbours given items stored in the columns "
+              "of a sparse matrix. Nearest Neighbors data is also returned "
+              "column-wise")
+      .method("dim", &HnswSparseCosine::getDim, "dimension of the items in the index")
+      .method("size", &HnswSparseCosine::size, "number of items added to the index")
+      .method("setNumThreads", &HnswSparseCosine::setNumThreads,
+              "set the number of threads to use")
+      .method("setGrainSize", &HnswSparseCosine::setGrainSize,
+              "set minimum grain size for using multiple threads")
+      .method("setDeterministic", &HnswSparseCosine::setDeterministic,
+              "add items the same way whatever the number of threads")
+      .method("markDeleted", &HnswSparseCosine::markDeleted,
+              "remove the item with the specified label from the index")
+      .method("reorder", &HnswSparseCosine::reorder,
+              "reorder the items in memory to speed up searching")
+      .method("freeze", &HnswSparseCosine::freeze,
+              "make the index read-only and compact it for searching")
+      .method("compressLinks", &HnswSparseCosine::compressLinks,
+              "freeze the index and compress its links")
+      .method("useSeparateStorage", &HnswSparseCosine::useSeparateStorage,
+              "store the vectors apart from the graph links")
+      .method("useAlignedLayout", &HnswSparseCosine::useAlignedLayout,
+              "align the vector of each item to a cache line");
+
+  Rcpp::class_<HnswSparseIp>("HnswSparseIp")
+      .constructor<int32_t, std::size_t, std::size_t, std::size_t>(
+          "constructor with dimension, number of items, M, ef")
+      .constructor<int32_t, std::size_t, std::size_t, std::size_t, std::size_t>(
+          "constructor with dimension, number of items, M, ef, random seed")
+      .method("setEf", &HnswSparseIp::setEf, "set ef value")
+      .method("addItemsSparseCol", &HnswSparseIp::addItemsSparseCol,
+              "add items stored in the columns of a sparse matrix")
+      .method("getAllNNsListSparseCol", &HnswSparseIp::getAllNNsListSparseCol,
+              "retrieve Nearest Neigbours given items stored in the columns "
+              "of a sparse matrix. Nearest Neighbors data is also returned "
+              "column-wise")
+      .method("dim", &HnswSparseIp::getDim, "dimension of the items in the index")
+      .method("size", &HnswSparseIp::size, "number of items added to the index")
+      .method("setNumThreads", &HnswSparseIp::setNumThreads,
+              "set the number of threads to use")
+      .method("setGrainSize", &HnswSparseIp::setGrainSize,
+              "set minimum grain size for using multiple threads")
+      .method("setDeterministic", &HnswSparseIp::setDeterministic,
+              "add items the same way whatever the number of threads")
+      .method("markDeleted", &HnswSparseIp::markDeleted,
+              "remove the item with the specified label from the index")
+      .method("reorder", &HnswSparseIp::reorder,
+              "reorder the items in memory to speed up searching")
+      .method("freeze", &HnswSparseIp::freeze,
+              "make the index read-only and compact it for searching")
+      .method("compressLinks", &HnswSparseIp::compressLinks,
+              "freeze the index and compress its links")
+      .method("useSeparateStorage", &HnswSparseIp::useSeparateStorage,
+              "store the vectors apart from the graph links")
+      .method("useAlignedLayout", &HnswSparseIp::useAlignedLayout,
+              "align the vector of each item to a cache line");
+
+  Rcpp::class_<HnswSparseEuclidean>("HnswSparseEuclidean")
+      .constructor<int32_t, std::size_t, std::size_t, std::size_t>(
+          "constructor with dimension, number of items, M, ef")
+      .constructor<int32_t, std::size_t, std::size_t, std::size_t, std::size_t>(
+          "constructor with dimension, number of items, M, ef, random seed")
+      .method("setEf", &HnswSparseEuclidean::setEf, "set ef value")
+      .method("addItemsSparseCol", &HnswSparseEuclidean::addItemsSparseCol,
+              "add items stored in the columns of a sparse matrix")
+      .method("getAllNNsListSparseCol", &HnswSparseEuclidean::getAllNNsListSparseCol,
+              "retrieve Nearest Neigbours given items stored in the columns "
+              "of a sparse matrix. Nearest Neighbors data is also returned "
+              "column-wise")
+      .method("dim", &HnswSparseEuclidean::getDim, "dimension of the items in the index")
+      .method("size", &HnswSparseEuclidean::size, "number of items added to the index")
+      .method("setNumThreads", &HnswSparseEuclidean::setNumThreads,
+              "set the number of threads to use")
+      .method("setGrainSize", &HnswSparseEuclidean::setGrainSize,
+              "set minimum grain size for using multiple threads")
+      .method("setDeterministic", &HnswSparseEuclidean::setDeterministic,
+              "add items the same way whatever the number of threads")
+      .method("markDeleted", &HnswSparseEuclidean::markDeleted,
+              "remove the item with the specified label from the index")
+      .method("reorder", &HnswSparseEuclidean::reorder,
+              "reorder the items in memory to speed up searching")
+      .method("freeze", &HnswSparseEuclidean::freeze,
+              "make the index read-only and compact it for searching")
+      .method("compressLinks", &HnswSparseEuclidean::compressLinks,
+              "freeze the index and compress its links")
+      .method("useSeparateStorage", &HnswSparseEuclidean::useSeparateStorage,
+              "store the vectors apart from the graph links")
+      .method("useAlignedLayout", &HnswSparseEuclidean::useAlignedLayout,
+              "align the vector of each item to a cache line");
 }
@@ -0,0 +1,128 @@
+//  RcppHNSW -- Rcpp bindings to hnswlib library for Approximate Nearest
+//  Neighbors
+//
+//  Copyright (C) 2023  James Melville
+//
+//  This file is part of RcppHNSW
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef RCPP_VECFILE_H
+#define RCPP_VECFILE_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// Reads vectors from a little-endian binary file a chunk at a time, so that
+// only one chunk needs to be in memory. Supported formats are:
+//  fvecs - each vector is an int32 dimension followed by that many float32s
+//  bvecs - each vector is an int32 dimension followed by that many uint8s
+//  float32 - the float32 values of each vector, one after the other
+class VecFileReader {
+public:
+  VecFileReader(const std::string &filename, const std::string &format,
+                std::size_t dim)
+      : input(filename, std::ios::binary), dim(dim), header_size(0),
+        value_size(sizeof(float)), record_size(0), n_items(0), n_read(0) {
+    if (format == "fvecs") {
+      header_size = sizeof(int32_t);
+    } else if (format == "bvecs") {
+      header_size = sizeof(int32_t);
+      value_size = sizeof(uint8_t);
+    } else if (format != "float32") {
+      throw std::runtime_error("Unknown vector file format: " + format);
+    }
+    if (!input.is_open()) {
+      throw std::runtime_error("Cannot open file " + filename);
+    }
+    input.seekg(0, input.end);
+    const std::size_t file_size = input.tellg();
+    input.seekg(0, input.beg);
+
+    record_size = header_size + dim * value_size;
+    if (dim == 0 || file_size % record_size != 0) {
+      throw std::runtime_error(
+          "Vector file does not contain a whole number of items with the "
+          "index dimensions");
+    }
+    n_items = file_size / record_size;
+  }
+
+  // total number of items in the file
+  auto size() const -> std::size_t { return n_items; }
+
+  // reads the next max_items items (or as many as are left) into data, stored
+  // one after the other, and returns the number read
+  auto read(std::vector<float> &data, std::size_t max_items) -> std::size_t {
+    const std::size_t nitems = std::min(max_items, n_items - n_read);
+    buffer.resize(nitems * record_size);
+    input.read(buffer.data(), buffer.size());
+    if (static_cast<std::size_t>(input.gcount()) != buffer.size()) {
+      throw std::runtime_error("Error reading vector file");
+    }
+
+    data.resize(nitems * dim);
+    for (std::size_t i = 0; i < nitems; i++) {
+      const char *record = buffer.data() + i * record_size;
+      if (header_size > 0) {
+        int32_t record_dim = 0;
+        std::memcpy(&record_dim, record, sizeof(record_dim));
+        if (record_dim < 0 || static_cast<std::size_t>(record_dim) != dim) {
+          throw std::runtime_error(
+              "Item in vector file has incorrect dimensions");
+        }
+      }
+      const char *values = record + header_size;
+      float *item = data.data() + i * dim;
+      if (value_size == sizeof(float)) {
+        std::memcpy(item, values, dim * sizeof(float));
+      } else {
+        for (std::size_t j = 0; j < dim; j++) {
+          item[j] = static_cast<uint8_t>(values[j]);
+        }
+      }
+    }
+    n_read += nitems;
+    return nitems;
+  }
+
+private:
+  std::ifstream input;
+  std::size_t dim;
+  std::size_t header_size;
+  std::size_t value_size;
+  std::size_t record_size;
+  std::size_t n_items;
+  std::size_t n_read;
+  std::vector<char> buffer;
+};
+
+// appends values to output as the little-endian type Out, e.g. int32 labels
+// or float32 distances
+template <typename Out, typename In>
+void write_vec_file(std::ofstream &output, const std::vector<In> &values) {
+  std::vector<Out> buffer(values.begin(), values.end());
+  output.write(reinterpret_cast<const char *>(buffer.data()),
+               buffer.size() * sizeof(Out));
+  if (!output) {
+    throw std::runtime_error("Error writing to file");
+  }
+}
+
+#endif // RCPP_VECFILE_H